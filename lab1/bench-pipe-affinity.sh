@@ -0,0 +1,43 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Compare the throughput of a 4-stage pipeline
+# with and without pinning its stages to adjacent cpus (-a).
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+mb=${BENCH_MB-256}
+runs=${BENCH_RUNS-3}
+
+cat >bench.sh <<EOF2
+head -c ${mb}000000 /dev/zero | gzip -1 | gzip -d | cksum > out
+EOF2
+
+now () {
+  date +%s.%N
+}
+
+run () {
+  best=
+  i=0
+  while test $i -lt $runs; do
+    start=$(now)
+    ../timetrash $1 bench.sh || exit
+    end=$(now)
+    best=$(awk "BEGIN { t = $end - $start;
+                        print (\"$best\" == \"\" || t < 0$best) ? t : 0$best }")
+    i=$((i + 1))
+  done
+  echo "$2: best of $runs: ${best}s, $(awk "BEGIN { printf \"%.1f\", $mb / $best }") MB/s"
+}
+
+run "" unpinned
+run -a pinned
+)
+
+status=$?
+rm -fr "$tmp"
+exit $status
@@ -1,6 +1,7 @@
 // UCLA CS 111 Lab 1 command interface
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct command *command_t;
 typedef struct command_stream *command_stream_t;
@@ -18,12 +19,35 @@ command_t read_command_stream (command_stream_t stream);
 /* Print a command to stdout, for debugging.  */
 void print_command (command_t);
 
+/* Serialize a command into a newly allocated buffer *BUF and return
+   its length, so that it can be sent to another process.  */
+size_t serialize_command (command_t, char **buf);
+
+/* Rebuild a command from a buffer written by serialize_command.
+   Return NULL if the buffer is malformed.  */
+command_t deserialize_command (char const *buf, size_t len);
+
 /* Execute a command.  Use "time travel" if the flag is set.  */
 void execute_command (command_t, bool);
 
+/* Pin the stages of each pipeline to adjacent cpus if ENABLE is set.  */
+void set_pipe_affinity (bool enable);
+
+/* Start the right-hand side of && and || before the left-hand side
+   finishes, when its effects are confined to its redirections.  */
+void set_speculation (bool enable);
+
+/* Add a worker daemon listening on the Unix socket PATH.  Time travel
+   runs independent commands on the workers instead of forking them.  */
+void add_worker (char const *path);
+
+/* Report per-worker job counts and cpu time on stderr if ENABLE.  */
+void set_worker_stats (bool enable);
+
 /* Return the exit status of a command, which must have previously
    been executed.  Wait for the command, if it is not already finished.  */
 int command_status (command_t);
 
-/* Used for main() to wait for all threads */
-void wait_all_threads ();
+/* Wait until every command started by time travel has finished, so
+   that command_status is known for all of them.  */
+void wait_all_commands (void);
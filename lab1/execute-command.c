@@ -1,5 +1,7 @@
 // UCLA CS 111 Lab 1 command execution
 
+#define _GNU_SOURCE		// sched_getcpu, CPU_* affinity macros, syscall
+
 #include "command.h"
 #include "command-internals.h"
 
@@ -17,6 +19,18 @@
 /* FIXME: You may need to add #include directives, macro definitions,
    static function definitions, etc.  */
 #include <string.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "alloc.h"
+#include "worker.h"
 
 enum file_open_mode
   {
@@ -25,25 +39,70 @@ enum file_open_mode
   };
 
 
-struct pid_node {
-  pid_t pid;
+/* a top-level command scheduled by time travel */
+struct job {
+  command_t command;
+  int ndeps;			// unfinished jobs this one waits for
+  bool done;
+  struct job_ref *dependents;	// jobs waiting for this one
+};
+typedef struct job* job_t;
+
+/* a process running part of a job: a simple command, a pipeline or
+   a redirected subshell, or the whole job if a worker runs it */
+struct job_unit {
+  job_t job;
+  command_t command;
+  pid_t pid;			// 0 if run by a worker
+  int fd;			// pidfd or worker socket being watched, or -1
+  struct worker *worker;	// worker running the job, or NULL
+  struct job_unit *prev, *next;	// running units
+};
+typedef struct job_unit* job_unit_t;
+
+struct job_ref {
+  job_t job;
+  struct job_ref *next;
+};
+
+struct job_node {
+  job_t job;
   enum file_open_mode mode;
-  struct pid_node *prev;
-  struct pid_node *next; 
+  struct job_node *prev;
+  struct job_node *next; 
+};
+typedef struct job_node* job_node_t;
+
+struct job_list {
+  job_node_t head;
+  job_node_t tail;
 };
-typedef struct pid_node* pid_node_t;
+typedef struct job_list* job_list_t; 
 
-struct pid_list {
-  pid_node_t head;
-  pid_node_t tail;
+/* canonical identity of a redirection file: the lexically normalized
+   absolute path, plus (st_dev, st_ino) once the file exists, so that
+   "x", "./x", "dir/../x" and links to x all name the same file */
+struct file_key {
+  char *path;
+  bool has_ino;
+  dev_t dev;
+  ino_t ino;
+  struct file_key *next;
+};
+typedef struct file_key* file_key_t;
+
+/* cache from a file name as spelled in the script to its key */
+struct file_alias {
+  char *name;
+  file_key_t key;
+  struct file_alias *next;
 };
-typedef struct pid_list* pid_list_t; 
 
 /* the node of the link list used to record
    which command use which file */
 struct file_usage {
-  char *file_name;
-  pid_list_t pids;
+  file_key_t key;
+  job_list_t jobs;
   struct file_usage *next;
 };
 typedef struct file_usage* file_usage_t;
@@ -58,17 +117,36 @@ typedef struct file_usage_list* file_usage_list_t;
 /* global records of the file usage by whole command stream */
 file_usage_list_t file_usage_stat_all;
 
-static pid_list_t
-make_pid_list()
+/* all canonical file keys, and the spellings resolved so far;
+   both live across commands so each name is resolved only once */
+static file_key_t file_keys;
+static struct file_alias *file_aliases;
+static char *cwd_path;
+
+/* pin the stages of a pipeline to adjacent cores (-a) */
+static bool pipe_affinity;
+
+/* stage index of the current process within a flattened pipeline,
+   or -1 if we are not inside a pipeline */
+static int pipe_stage = -1;
+
+/* index (among the allowed cpus) the first stage is pinned to */
+static int pipe_base_cpu;
+
+/* start the right-hand side of && and || early when it is safe (-s) */
+static bool speculation;
+
+static job_list_t
+make_job_list()
 {
-  pid_list_t l = (pid_list_t) malloc(sizeof(struct pid_list));
+  job_list_t l = (job_list_t) malloc(sizeof(struct job_list));
   l->head = NULL;
   l->tail = NULL;
   return l;
 }
 
 static void
-add_to_pid_list(pid_list_t l, pid_node_t n)
+add_to_job_list(job_list_t l, job_node_t n)
 {
   if (l->head && l->tail)
     {
@@ -83,10 +161,10 @@ add_to_pid_list(pid_list_t l, pid_node_t n)
     }
 }
 
-static pid_node_t 
-find_last_pid_by_mode(pid_list_t l, enum file_open_mode mode)
+static job_node_t 
+find_last_job_by_mode(job_list_t l, enum file_open_mode mode)
 {
-  pid_node_t p = l->tail;
+  job_node_t p = l->tail;
   while (p && p->mode != mode) 
     {
       if (p->prev)
@@ -100,17 +178,139 @@ find_last_pid_by_mode(pid_list_t l, enum file_open_mode mode)
     return NULL;
 }
 
+/* lexically normalize NAME into an absolute path: prefix the current
+   directory, drop "." and empty components, and resolve ".." */
+static char *
+normalize_path(const char *name)
+{
+  size_t cwd_len, len;
+  char *buf, *src, *dst, *comp;
+
+  if (cwd_path == NULL)
+    {
+      cwd_path = getcwd(NULL, 0);
+      if (cwd_path == NULL)
+	cwd_path = strdup("/");
+    }
+  cwd_len = name[0] == '/' ? 0 : strlen(cwd_path);
+  len = cwd_len + strlen(name) + 2;
+
+  src = (char *) malloc(len);
+  if (cwd_len)
+    sprintf(src, "%s/%s", cwd_path, name);
+  else
+    strcpy(src, name);
+
+  buf = (char *) malloc(len);
+  dst = buf;
+  for (comp = strtok(src, "/"); comp; comp = strtok(NULL, "/"))
+    {
+      if (strcmp(comp, ".") == 0)
+	continue;
+      if (strcmp(comp, "..") == 0)
+	{
+	  while (dst > buf && *--dst != '/');
+	  continue;
+	}
+      *dst++ = '/';
+      strcpy(dst, comp);
+      dst += strlen(comp);
+    }
+  if (dst == buf)
+    *dst++ = '/';
+  *dst = '\0';
+
+  free(src);
+  return buf;
+}
+
+/* fill in the inode identity of KEY if the file exists by now */
+static void
+stat_file_key(file_key_t key)
+{
+  struct stat st;
+  if (!key->has_ino && stat(key->path, &st) == 0)
+    {
+      key->has_ino = true;
+      key->dev = st.st_dev;
+      key->ino = st.st_ino;
+    }
+}
+
+static bool
+same_file(file_key_t a, file_key_t b)
+{
+  return a == b
+    || (a->has_ino && b->has_ino && a->dev == b->dev && a->ino == b->ino);
+}
+
+/* map a file name from the script to its canonical key */
+static file_key_t
+canonical_file_key(char *file_name)
+{
+  struct file_alias *a;
+  file_key_t key;
+  char *path;
+
+  for (a = file_aliases; a; a = a->next)
+    if (strcmp(a->name, file_name) == 0)
+      {
+	stat_file_key(a->key);	// it may have been created since
+	return a->key;
+      }
+
+  path = normalize_path(file_name);
+  for (key = file_keys; key; key = key->next)
+    if (strcmp(key->path, path) == 0)
+      break;
+
+  if (key)
+    {
+      free(path);
+      stat_file_key(key);
+    }
+  else
+    {
+      struct file_key probe;
+      probe.path = path;
+      probe.has_ino = false;
+      stat_file_key(&probe);
+
+      /* a new spelling of an existing file, e.g. through a link */
+      for (key = file_keys; key; key = key->next)
+	if (same_file(key, &probe))
+	  break;
+
+      if (key)
+	free(path);
+      else
+	{
+	  key = (file_key_t) malloc(sizeof(struct file_key));
+	  *key = probe;
+	  key->next = file_keys;
+	  file_keys = key;
+	}
+    }
+
+  a = (struct file_alias *) malloc(sizeof(struct file_alias));
+  a->name = strdup(file_name);
+  a->key = key;
+  a->next = file_aliases;
+  file_aliases = a;
+  return key;
+}
+
 /* find whether a file has been used by a command in a file usage list */
 static file_usage_t
-retrieve_file_usage(file_usage_list_t l, char *file_name) 
+retrieve_file_usage(file_usage_list_t l, file_key_t key) 
 {
-  if (file_name == NULL)
+  if (key == NULL)
     return NULL;
 
   file_usage_t p = l->head;
   while (p)
     {
-      if (strcmp(p->file_name, file_name)==0)
+      if (same_file(p->key, key))
 	{
 	  return p;
 	}
@@ -122,31 +322,30 @@ retrieve_file_usage(file_usage_list_t l, char *file_name)
 
 /* Called when there is a new command depending on a file used by previous commands */
 static void
-update_file_usage(file_usage_t fu, pid_t pid, enum file_open_mode mode)
+update_file_usage(file_usage_t fu, job_t job, enum file_open_mode mode)
 {
   if (fu)
     {
-      pid_node_t node = (pid_node_t) malloc(sizeof(struct pid_node));
-      node->pid = pid;
+      job_node_t node = (job_node_t) malloc(sizeof(struct job_node));
+      node->job = job;
       node->mode = mode;
       node->prev = NULL;
       node->next = NULL;
-      add_to_pid_list(fu->pids, node);
+      add_to_job_list(fu->jobs, node);
     }
 }
 
 /* Called only if the file never used by previous command; 
    if the file already used by previous command, call update_file_usage() */
 static void
-add_file_usage(file_usage_list_t l, pid_t pid, char *file_name, enum file_open_mode mode)
+add_file_usage(file_usage_list_t l, job_t job, file_key_t key, enum file_open_mode mode)
 {
   file_usage_t new_node = (file_usage_t) malloc(sizeof(struct file_usage));
-  new_node->file_name = (char *) malloc(strlen(file_name) + 1);
-  strcpy(new_node->file_name, file_name);
-  new_node->pids = make_pid_list();
+  new_node->key = key;
+  new_node->jobs = make_job_list();
   new_node->next = NULL;
 
-  update_file_usage(new_node, pid, mode);
+  update_file_usage(new_node, job, mode);
 
   if (l->head && l->tail)
     {
@@ -163,16 +362,16 @@ add_file_usage(file_usage_list_t l, pid_t pid, char *file_name, enum file_open_m
 /* you may want to use this function to add file usage; 
    selectively call update_file_usage() or add_file_usage() */
 static void
-try_add_file_usage(file_usage_list_t l, pid_t pid, char *file_name, enum file_open_mode mode)
+try_add_file_usage(file_usage_list_t l, job_t job, file_key_t key, enum file_open_mode mode)
 {
-   file_usage_t fu = retrieve_file_usage(l, file_name);
+   file_usage_t fu = retrieve_file_usage(l, key);
    if (fu)
     {
-       update_file_usage(fu, pid, mode);
+       update_file_usage(fu, job, mode);
     }
   else
     {
-       add_file_usage(l, pid, file_name, mode);
+       add_file_usage(l, job, key, mode);
     }
 }
 
@@ -190,9 +389,75 @@ make_file_usage_list()
 int
 command_status (command_t c)
 {
+  /* a time-travel sequence has the status of its last job */
+  if (c->status == -1 && c->type == SEQUENCE_COMMAND)
+    return command_status(c->u.command[1]);
   return c->status;
 }
 
+void
+set_pipe_affinity (bool enable)
+{
+  pipe_affinity = enable;
+}
+
+void
+set_speculation (bool enable)
+{
+  speculation = enable;
+}
+
+/* number of stages in a flattened pipeline, e.g. 3 for a | b | c */
+static int
+count_pipe_stages (command_t c)
+{
+  if (c->type == PIPE_COMMAND)
+    return count_pipe_stages(c->u.command[0])
+      + count_pipe_stages(c->u.command[1]);
+  return 1;
+}
+
+/* index of the cpu we are running on among the cpus we may use */
+static int
+current_cpu_index (void)
+{
+  cpu_set_t allowed;
+  int cpu = sched_getcpu();
+  int i, n = 0;
+
+  if (cpu < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return 0;
+  for (i = 0; i < cpu && i < CPU_SETSIZE; i++)
+    if (CPU_ISSET(i, &allowed))
+      n++;
+  return n;
+}
+
+/* pin the calling process to the cpu of pipeline stage STAGE:
+   stages are laid out on adjacent allowed cpus starting from
+   pipe_base_cpu, wrapping around if there are more stages than cpus */
+static void
+pin_pipe_stage (int stage)
+{
+  cpu_set_t allowed, target;
+  int i, n, nallowed = 0;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return;
+  nallowed = CPU_COUNT(&allowed);
+  if (nallowed <= 1)
+    return;
+
+  n = (pipe_base_cpu + stage) % nallowed;
+  for (i = 0; i < CPU_SETSIZE; i++)
+    if (CPU_ISSET(i, &allowed) && n-- == 0)
+      break;
+
+  CPU_ZERO(&target);
+  CPU_SET(i, &target);
+  sched_setaffinity(0, sizeof(target), &target);	// best effort
+}
+
 static void
 redirect_input (char *input)
 {
@@ -219,6 +484,314 @@ redirect_output (char *output)
     }
 }
 
+int execute_command_standard(command_t c);
+
+/* in a child process: redirect and run the simple command C */
+static void
+exec_simple_command(command_t c)
+{
+  if (pipe_affinity && pipe_stage >= 0)
+    pin_pipe_stage(pipe_stage);
+  redirect_input(c->input);
+  redirect_output(c->output);
+  _exit(execvp(c->u.word[0], c->u.word));
+}
+
+/* Speculative && and ||: the right-hand side is started in its own
+   process group while the left-hand side runs, with every output
+   redirection pointed at a private temporary file next to the file
+   its target names, and its stderr sent to an anonymous temporary.
+   If the left-hand side's status lets the right-hand side run, the
+   temporaries are renamed over those files and the saved stderr is
+   replayed; otherwise the group is killed and the temporaries are
+   removed. */
+
+struct spec_output {
+  command_t command;		// the command whose output is diverted
+  char *target;			// the redirection as written
+  char *dest;			// the file it names, with symlinks resolved
+  char *temp;
+  struct spec_output *next;
+};
+
+/* record every redirection file of C in L, with its mode */
+static void
+collect_command_files(command_t c, file_usage_list_t l)
+{
+  switch (c->type)
+    {
+    case AND_COMMAND:
+    case OR_COMMAND:
+    case SEQUENCE_COMMAND:
+    case PIPE_COMMAND:
+      collect_command_files(c->u.command[0], l);
+      collect_command_files(c->u.command[1], l);
+      return;
+    case SUBSHELL_COMMAND:
+      collect_command_files(c->u.subshell_command, l);
+      break;
+    case SIMPLE_COMMAND:
+      break;
+    }
+  if (c->input)
+    try_add_file_usage(l, NULL, canonical_file_key(c->input), READ);
+  if (c->output)
+    try_add_file_usage(l, NULL, canonical_file_key(c->output), WRITE);
+}
+
+/* true if every simple command in C reads its stdin from a
+   redirection or a pipe and writes its stdout to one, so that C
+   neither consumes the shell's input nor has side effects besides its
+   redirection targets (its stderr is diverted separately) */
+static bool
+io_confined(command_t c, bool in, bool out)
+{
+  in = in || c->input;
+  out = out || c->output;
+  switch (c->type)
+    {
+    case SIMPLE_COMMAND:
+      return in && out;
+    case SUBSHELL_COMMAND:
+      return io_confined(c->u.subshell_command, in, out);
+    case PIPE_COMMAND:
+      return io_confined(c->u.command[0], in, true)
+	&& io_confined(c->u.command[1], true, out);
+    default:
+      return io_confined(c->u.command[0], in, out)
+	&& io_confined(c->u.command[1], in, out);
+    }
+}
+
+static int
+count_mode(job_list_t l, enum file_open_mode mode)
+{
+  int n = 0;
+  job_node_t p;
+  for (p = l->head; p; p = p->next)
+    n += p->mode == mode;
+  return n;
+}
+
+/* ask the dependency analyzer whether RHS may run alongside LHS:
+   RHS must be confined to its redirections, must not touch a file
+   LHS writes or write a file LHS reads, and must not read back or
+   write twice any file it writes itself */
+static bool
+can_speculate(command_t lhs, command_t rhs)
+{
+  file_usage_list_t lfiles, rfiles;
+  file_usage_t u, f;
+
+  if (!io_confined(rhs, false, false))
+    return false;
+
+  lfiles = make_file_usage_list();
+  rfiles = make_file_usage_list();
+  collect_command_files(lhs, lfiles);
+  collect_command_files(rhs, rfiles);
+
+  for (u = rfiles->head; u; u = u->next)
+    {
+      int writes = count_mode(u->jobs, WRITE);
+      if (writes > 1 || (writes && count_mode(u->jobs, READ)))
+	return false;
+      f = retrieve_file_usage(lfiles, u->key);
+      if (f && (writes || count_mode(f->jobs, WRITE)))
+	return false;
+    }
+  return true;
+}
+
+/* find the file that redirecting to TARGET would write: TARGET itself
+   if it does not exist yet, else where its symlinks lead.  Return NULL
+   if renaming a new file over that one would not look like writing
+   through it -- it is not a regular file, has other hard links, or is
+   a dangling symlink. */
+static char *
+spec_dest(const char *target, struct stat *st)
+{
+  if (stat(target, st) == 0)
+    {
+      if (!S_ISREG(st->st_mode) || st->st_nlink != 1)
+	return NULL;
+      return realpath(target, NULL);
+    }
+  else if (errno == ENOENT && lstat(target, st) == -1)
+    {
+      st->st_mode = 0;
+      return strdup(target);
+    }
+  else
+    return NULL;
+}
+
+/* create a temporary file in the directory of DEST that can replace
+   it: with DEST's mode and owner, if DEST exists as described by ST */
+static char *
+make_spec_temp(const char *dest, const struct stat *st)
+{
+  const char *base = strrchr(dest, '/');
+  size_t dirlen = base ? (size_t) (base - dest + 1) : 0;
+  char *temp;
+  mode_t mask;
+  int fd, ok;
+
+  base = base ? base + 1 : dest;
+  temp = (char *) checked_malloc(strlen(dest) + sizeof(".spec-XXXXXX") + 1);
+  sprintf(temp, "%.*s.%s.spec-XXXXXX", (int) dirlen, dest, base);
+  fd = mkstemp(temp);
+  if (fd == -1)
+    {
+      free(temp);
+      return NULL;
+    }
+
+  if (st->st_mode)
+    ok = fchmod(fd, st->st_mode & 07777) == 0
+      && fchown(fd, st->st_uid, st->st_gid) == 0;
+  else
+    {
+      /* same permissions as a regular redirection would create */
+      mask = umask(0);
+      umask(mask);
+      ok = fchmod(fd, 0644 & ~mask) == 0;
+    }
+  close(fd);
+  if (!ok)
+    {
+      unlink(temp);
+      free(temp);
+      return NULL;
+    }
+  return temp;
+}
+
+static void
+free_spec_outputs(struct spec_output *o, bool discard)
+{
+  while (o)
+    {
+      struct spec_output *next = o->next;
+      if (discard && o->temp)
+	unlink(o->temp);
+      free(o->dest);
+      free(o->temp);
+      free(o);
+      o = next;
+    }
+}
+
+/* copy what the committed right-hand side wrote to stderr, saved in
+   ERR, to the real stderr */
+static void
+replay_spec_stderr(int err)
+{
+  char buf[4096];
+  ssize_t n;
+
+  lseek(err, 0, SEEK_SET);
+  while ((n = read(err, buf, sizeof(buf))) > 0)
+    if (write(STDERR_FILENO, buf, n) != n)
+      break;
+}
+
+/* divert every output redirection in C to a temporary file;
+   return false if a temporary cannot be created */
+static bool
+make_spec_outputs(command_t c, struct spec_output **list)
+{
+  switch (c->type)
+    {
+    case SIMPLE_COMMAND:
+      break;
+    case SUBSHELL_COMMAND:
+      if (!make_spec_outputs(c->u.subshell_command, list))
+	return false;
+      break;
+    default:
+      return make_spec_outputs(c->u.command[0], list)
+	&& make_spec_outputs(c->u.command[1], list);
+    }
+
+  if (c->output)
+    {
+      struct spec_output *o = (struct spec_output *) checked_malloc(sizeof(struct spec_output));
+      struct stat st;
+      o->command = c;
+      o->target = c->output;
+      o->dest = spec_dest(c->output, &st);
+      o->temp = o->dest ? make_spec_temp(o->dest, &st) : NULL;
+      o->next = *list;
+      *list = o;
+      if (o->temp == NULL)
+	return false;
+    }
+  return true;
+}
+
+/* run the && or || command C speculatively; return -1 without
+   running anything if C is not eligible */
+static int
+execute_speculative(command_t c)
+{
+  command_t lhs = c->u.command[0], rhs = c->u.command[1];
+  struct spec_output *outs = NULL, *o;
+  char errname[] = "/tmp/timetrash-spec-XXXXXX";
+  bool run_rhs;
+  int status, err;
+  pid_t pid;
+
+  if (!can_speculate(lhs, rhs))
+    return -1;
+  if (!make_spec_outputs(rhs, &outs)
+      || (err = mkstemp(errname)) == -1)
+    {
+      free_spec_outputs(outs, true);
+      return -1;
+    }
+  unlink(errname);
+  fcntl(err, F_SETFD, FD_CLOEXEC);
+
+  for (o = outs; o; o = o->next)
+    o->command->output = o->temp;
+  while ((pid = fork()) < 0);
+  if (pid == 0)
+    {
+      setpgid(0, 0);		// so the whole right-hand side can be killed
+      dup2(err, STDERR_FILENO);
+      close(err);
+      execute_command_standard(rhs);
+      _exit(command_status(rhs));
+    }
+  setpgid(pid, pid);
+  for (o = outs; o; o = o->next)
+    o->command->output = o->target;
+
+  execute_command_standard(lhs);
+  run_rhs = (command_status(lhs) == 0) == (c->type == AND_COMMAND);
+
+  if (run_rhs)
+    {
+      waitpid(pid, &status, 0);
+      replay_spec_stderr(err);
+      for (o = outs; o; o = o->next)
+	if (rename(o->temp, o->dest) == -1)
+	  error(0, errno, "%s", o->target);
+      rhs->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+      c->status = rhs->status;
+    }
+  else
+    {
+      kill(-pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      c->status = command_status(lhs);
+    }
+  close(err);
+  free_spec_outputs(outs, !run_rhs);
+  return 0;
+}
+
 /* lab 1b: standard execution
  * We apply recursion to execute code in sequence
  * return -1 if error occurs
@@ -230,6 +803,8 @@ execute_command_standard(command_t c)
     return 0;
   switch(c->type){
   case AND_COMMAND:{
+    if (speculation && execute_speculative(c) == 0)
+      break;
     execute_command_standard(c->u.command[0]);
     if (command_status(c->u.command[0]) == 0)
       {
@@ -249,6 +824,8 @@ execute_command_standard(command_t c)
     break;
   }
   case OR_COMMAND:{
+    if (speculation && execute_speculative(c) == 0)
+      break;
     execute_command_standard(c->u.command[0]);
     if (command_status(c->u.command[0]) != 0)
       {
@@ -265,9 +842,14 @@ execute_command_standard(command_t c)
     /* Take the following steps:
      * 1. create a pipe, which has a read/write end
      * 2. redirect stdin to the read end, and stdout to the write end
-     * 3. execute two commands			
+     * 3. execute two commands concurrently, then wait for the writer
      */
     int pipefd[2];
+    int saved_stage = pipe_stage;
+    int stage = pipe_stage < 0 ? 0 : pipe_stage;
+    if (pipe_stage < 0 && pipe_affinity)
+      pipe_base_cpu = current_cpu_index();
+
     pipe(pipefd);
     pid_t pid;
     while ((pid = fork()) < 0);
@@ -275,19 +857,29 @@ execute_command_standard(command_t c)
     if(pid==0){	//child: execute a in a|b. Only write data
       close(pipefd[0]);	//close read end
       dup2(pipefd[1],STDOUT_FILENO);	//redirect stdout to pipe
+      close(pipefd[1]);
+      pipe_stage = stage;
       if(execute_command_standard(c->u.command[0])==-1)
 	_exit(-1);
       _exit(command_status(c->u.command[0]));
     }
     else{	//parent: execute b in a|b. Only read data
+      int saved_stdin = dup(STDIN_FILENO);
+      int status, r;
       close(pipefd[1]);	//close write end
       dup2(pipefd[0],STDIN_FILENO);	//redirect stdin to pipe
-      int status;
-      waitpid(pid,&status,0);
-      if(WEXITSTATUS(status)==-1)
-	return -1;
+      close(pipefd[0]);
+
+      /* b must run while a is still writing; waiting for a first
+         would deadlock as soon as a fills the pipe buffer */
+      pipe_stage = stage + count_pipe_stages(c->u.command[0]);
+      r = execute_command_standard(c->u.command[1]);
+      pipe_stage = saved_stage;
 
-      if(execute_command_standard(c->u.command[1])==-1)
+      dup2(saved_stdin, STDIN_FILENO);
+      close(saved_stdin);
+      waitpid(pid,&status,0);
+      if(r==-1)
 	return -1;
       c->status = command_status(c->u.command[1]);
     }
@@ -298,29 +890,8 @@ execute_command_standard(command_t c)
     pid_t pid;
     while ((pid = fork()) < 0);
 	
-    if(pid==0){		//wait for pid
-      //I/O redirection
-
-      int res;
-      redirect_input(c->input);
-      redirect_output(c->output);
-
-      //execute command
-      res = execvp(c->u.word[0],c->u.word);
-      /*if(c->input!=NULL)
-	{
-	dup2(oldin,STDIN_FILENO);
-	close(oldin);
-					
-	}
-	if(c->output!=NULL)
-	{
-	dup2(oldout,STDOUT_FILENO);
-	close(oldout);
-	}*/
-
-      _exit(res);
-    }
+    if(pid==0)		//I/O redirection, then execute command
+      exec_simple_command(c);
     else	//parent
       {
 	int status;
@@ -354,36 +925,38 @@ check_single_file_dependency(char *file_name, enum file_open_mode mode, file_usa
   if (file_name == NULL)
     return;
   
+  file_key_t key = canonical_file_key(file_name);
+
   /*  file aleady taken as the dependency of current command */
-  if (retrieve_file_usage(l, file_name))
+  if (retrieve_file_usage(l, key))
     return;
   
-  file_usage_t fu = retrieve_file_usage(file_usage_stat_all, file_name);
+  file_usage_t fu = retrieve_file_usage(file_usage_stat_all, key);
   
-  pid_node_t pn = NULL;
+  job_node_t pn = NULL;
   
   if (fu)
     {
       if (mode == READ)
 	{
-	  pn = find_last_pid_by_mode(fu->pids, WRITE);
+	  pn = find_last_job_by_mode(fu->jobs, WRITE);
 	}
       else 
 	{
-	  pn = fu->pids->tail;
+	  pn = fu->jobs->tail;
 	}
   
       if (pn)
-	add_file_usage(l, pn->pid, file_name, mode);
+	add_file_usage(l, pn->job, key, mode);
       else
-	add_file_usage(l, 0, file_name, mode);
+	add_file_usage(l, NULL, key, mode);
     }
   else
     {
       /* if a file not used by previous commands,
-         we still save it into dependency list with pid=0, 
+         we still save it into dependency list with job=NULL, 
          indicating current command first use the file*/
-      add_file_usage(l, 0, file_name, mode);
+      add_file_usage(l, NULL, key, mode);
     }
   
 }
@@ -418,6 +991,550 @@ check_command_file_dependency(command_t c, file_usage_list_t l)
   
 }
 
+/* Time travel runs every top-level command as a job.  A job is
+   launched as soon as all jobs it depends on have finished.  The
+   shell itself walks the job's &&, || and ; operators: it forks a
+   process (a unit) only for each simple command, pipeline and
+   redirected subshell, and when a unit exits, decides from its status
+   which part of the job runs next.  Completions are delivered through
+   an epoll set watching one pidfd per running unit (or a SIGCHLD
+   signalfd on kernels without pidfd_open), so no process ever polls
+   or blocks on another. */
+
+static int epoll_fd = -1;
+static int sigchld_fd = -1;	// signalfd fallback, -1 if pidfds work
+static sigset_t sigchld_saved_mask;
+static job_unit_t running_units;
+static int jobs_pending;	// submitted but not yet reaped
+
+static int
+open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void) pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void
+init_event_loop(void)
+{
+  if (epoll_fd >= 0)
+    return;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1)
+    error(1, errno, "epoll_create1");
+}
+
+/* switch to reaping through a SIGCHLD signalfd */
+static void
+init_sigchld_fd(void)
+{
+  sigset_t mask;
+  struct epoll_event ev;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &sigchld_saved_mask);
+  sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigchld_fd == -1)
+    error(1, errno, "signalfd");
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;		// NULL marks the signalfd
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &ev) == -1)
+    error(1, errno, "epoll_ctl");
+}
+
+/* Jobs can also be shipped to timetrash-worker daemons (-w).  Each
+   job gets its own connection; the worker answers with the job's exit
+   status and resource usage once it is done, so a worker socket is
+   watched in the same epoll set as a pidfd. */
+
+struct worker {
+  char *path;
+  int running;			// jobs in flight on this worker
+  int jobs;			// jobs completed
+  int64_t utime_usec, stime_usec;
+  struct worker *next;
+};
+
+static struct worker *workers;
+static bool worker_stats;
+
+void
+add_worker(char const *path)
+{
+  struct worker *w = (struct worker *) checked_malloc(sizeof(struct worker));
+  struct worker **p = &workers;
+  w->path = strdup(path);
+  w->running = w->jobs = 0;
+  w->utime_usec = w->stime_usec = 0;
+  w->next = NULL;
+  while (*p)
+    p = &(*p)->next;
+  *p = w;
+}
+
+void
+set_worker_stats(bool enable)
+{
+  worker_stats = enable;
+}
+
+bool
+write_full(int fd, void const *buf, size_t n)
+{
+  char const *p = buf;
+  while (n > 0)
+    {
+      ssize_t w = write(fd, p, n);
+      if (w < 0 && errno == EINTR)
+	continue;
+      if (w <= 0)
+	return false;
+      p += w;
+      n -= w;
+    }
+  return true;
+}
+
+bool
+read_full(int fd, void *buf, size_t n)
+{
+  char *p = buf;
+  while (n > 0)
+    {
+      ssize_t r = read(fd, p, n);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      p += r;
+      n -= r;
+    }
+  return true;
+}
+
+bool
+write_full_fds(int fd, void const *buf, size_t n, int const *fds)
+{
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(WORKER_NFDS * sizeof(int))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  ssize_t w;
+
+  iov.iov_base = (void *) buf;
+  iov.iov_len = n;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(WORKER_NFDS * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds, WORKER_NFDS * sizeof(int));
+
+  while ((w = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    continue;
+  if (w <= 0)
+    return false;
+  /* the descriptors went with the first byte */
+  return write_full(fd, (char const *) buf + w, n - w);
+}
+
+bool
+read_full_fds(int fd, void *buf, size_t n, int *fds)
+{
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(WORKER_NFDS * sizeof(int))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  ssize_t r;
+  bool got = false;
+
+  iov.iov_base = buf;
+  iov.iov_len = n;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  while ((r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    continue;
+  if (r <= 0)
+    return false;
+  for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS
+	&& cm->cmsg_len == CMSG_LEN(WORKER_NFDS * sizeof(int)))
+      {
+	memcpy(fds, CMSG_DATA(cm), WORKER_NFDS * sizeof(int));
+	got = true;
+      }
+  return got && !(msg.msg_flags & MSG_CTRUNC)
+    && read_full(fd, (char *) buf + r, n - r);
+}
+
+static job_unit_t new_unit(job_t job, command_t c);
+static void free_unit(job_unit_t u);
+
+/* send JOB to the least loaded worker; return false if none takes it */
+static bool
+launch_remote_job(job_t job)
+{
+  extern char **environ;
+  struct worker_request req;
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  struct worker *w, *best = NULL;
+  static int const stdio[WORKER_NFDS] = { 0, 1, 2 };
+  char *cmd, *env, *cwd;
+  size_t env_len = 0;
+  char **e;
+  bool ok;
+  int fd;
+
+  for (w = workers; w; w = w->next)
+    if (!best || w->running < best->running)
+      best = w;
+  if (!best || strlen(best->path) >= sizeof(addr.sun_path))
+    return false;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return false;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, best->path);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+      error(0, errno, "worker %s", best->path);
+      close(fd);
+      return false;
+    }
+
+  for (e = environ; *e; e++)
+    env_len += strlen(*e) + 1;
+  env = (char *) checked_malloc(env_len);
+  env_len = 0;
+  for (e = environ; *e; e++)
+    {
+      strcpy(env + env_len, *e);
+      env_len += strlen(*e) + 1;
+    }
+  cwd = getcwd(NULL, 0);
+
+  req.magic = WORKER_MAGIC;
+  req.cwd_len = cwd ? strlen(cwd) : 0;
+  req.env_len = env_len;
+  req.command_len = serialize_command(job->command, &cmd);
+  ok = write_full_fds(fd, &req, sizeof(req), stdio)
+    && write_full(fd, cwd, req.cwd_len)
+    && write_full(fd, env, req.env_len)
+    && write_full(fd, cmd, req.command_len);
+  free(cmd);
+  free(env);
+  free(cwd);
+  if (!ok)
+    {
+      close(fd);
+      return false;
+    }
+
+  job_unit_t u = new_unit(job, job->command);
+  u->fd = fd;
+  u->worker = best;
+  best->running++;
+  ev.events = EPOLLIN;
+  ev.data.ptr = u;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    error(1, errno, "epoll_ctl");
+  return true;
+}
+
+static void finish_unit(job_unit_t u, int status);
+
+static int
+exit_status(int wait_status)
+{
+  return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128;
+}
+
+static job_unit_t
+new_unit(job_t job, command_t c)
+{
+  job_unit_t u = (job_unit_t) checked_malloc(sizeof(struct job_unit));
+  u->job = job;
+  u->command = c;
+  u->pid = 0;
+  u->fd = -1;
+  u->worker = NULL;
+  u->prev = NULL;
+  u->next = running_units;
+  if (running_units)
+    running_units->prev = u;
+  running_units = u;
+  return u;
+}
+
+static void
+free_unit(job_unit_t u)
+{
+  if (u->fd >= 0)
+    close(u->fd);	// also drops it from the epoll set
+  if (u->prev)
+    u->prev->next = u->next;
+  else
+    running_units = u->next;
+  if (u->next)
+    u->next->prev = u->prev;
+  free(u);
+}
+
+/* fork a unit running C, part of JOB */
+static void
+launch_unit(job_t job, command_t c)
+{
+  struct epoll_event ev;
+  job_unit_t u;
+  pid_t pid;
+
+  while ((pid = fork()) < 0);	//wait until we can create a process
+  if (pid == 0)
+    {
+      if (sigchld_fd >= 0)
+	sigprocmask(SIG_SETMASK, &sigchld_saved_mask, NULL);
+      if (c->type == SIMPLE_COMMAND)
+	exec_simple_command(c);
+      execute_command_standard(c);
+      _exit(command_status(c));
+    }
+
+  u = new_unit(job, c);
+  u->pid = pid;
+  if (sigchld_fd >= 0)
+    return;
+
+  u->fd = open_pidfd(pid);
+  if (u->fd == -1)
+    {
+      if (errno != ENOSYS)
+	error(1, errno, "pidfd_open");
+      /* the child may already be gone; the signalfd only reports
+	 exits after it is set up, so reap it by hand once */
+      init_sigchld_fd();
+      int status;
+      if (waitpid(pid, &status, WNOHANG) == pid)
+	finish_unit(u, exit_status(status));
+      return;
+    }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = u;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, u->fd, &ev) == -1)
+    error(1, errno, "epoll_ctl");
+}
+
+/* start C, part of JOB: descend to the first operand of &&, || and ;
+   (and of a subshell without redirections) and fork a unit for it */
+static void
+launch_command(job_t job, command_t c)
+{
+  switch (c->type)
+    {
+    case AND_COMMAND:
+    case OR_COMMAND:
+      /* a speculative right-hand side overlaps the left-hand side,
+	 so the pair runs in one unit */
+      if (speculation && can_speculate(c->u.command[0], c->u.command[1]))
+	break;
+      /* fall through */
+    case SEQUENCE_COMMAND:
+      launch_command(job, c->u.command[0]);
+      return;
+    case SUBSHELL_COMMAND:
+      if (!c->input && !c->output)
+	{
+	  launch_command(job, c->u.subshell_command);
+	  return;
+	}
+      break;
+    default:
+      break;
+    }
+  launch_unit(job, c);
+}
+
+static void
+launch_job(job_t job)
+{
+  if (!workers || !launch_remote_job(job))
+    launch_command(job, job->command);
+}
+
+/* the node of the command tree ROOT that has C as an operand */
+static command_t
+command_parent(command_t root, command_t c)
+{
+  command_t p;
+
+  switch (root->type)
+    {
+    case AND_COMMAND:
+    case OR_COMMAND:
+    case SEQUENCE_COMMAND:
+      if (root->u.command[0] == c || root->u.command[1] == c)
+	return root;
+      p = command_parent(root->u.command[0], c);
+      return p ? p : command_parent(root->u.command[1], c);
+    case SUBSHELL_COMMAND:
+      if (root->u.subshell_command == c)
+	return root;
+      return command_parent(root->u.subshell_command, c);
+    default:
+      return NULL;
+    }
+}
+
+static void finish_job(job_t job, int status);
+
+/* C, part of JOB, has finished with its status set: run the operand
+   that its && || or ; calls for next, or pass the status up the tree */
+static void
+command_done(job_t job, command_t c)
+{
+  command_t p;
+
+  for (; c != job->command; c = p)
+    {
+      p = command_parent(job->command, c);
+      if (p->type != SUBSHELL_COMMAND && c == p->u.command[0]
+	  && (p->type == SEQUENCE_COMMAND
+	      || (p->type == AND_COMMAND) == (c->status == 0)))
+	{
+	  launch_command(job, p->u.command[1]);
+	  return;
+	}
+      p->status = c->status;
+    }
+  finish_job(job, c->status);
+}
+
+/* record the exit STATUS of unit U and go on with its job */
+static void
+finish_unit(job_unit_t u, int status)
+{
+  job_t job = u->job;
+  command_t c = u->command;
+
+  free_unit(u);
+  c->status = status;
+  command_done(job, c);
+}
+
+/* record the exit STATUS of JOB and launch the jobs that were waiting for it */
+static void
+finish_job(job_t job, int status)
+{
+  struct job_ref *r;
+
+  job->done = true;
+  job->command->status = status;
+  jobs_pending--;
+
+  for (r = job->dependents; r; r = r->next)
+    if (--r->job->ndeps == 0)
+      launch_job(r->job);
+}
+
+/* collect the reply for a job run by a worker */
+static void
+finish_remote_unit(job_unit_t u)
+{
+  struct worker_reply reply;
+  struct worker *w = u->worker;
+  job_t job = u->job;
+
+  w->running--;
+  if (!read_full(u->fd, &reply, sizeof(reply)))
+    {
+      error(0, 0, "worker %s: lost connection", w->path);
+      reply.status = 1;
+    }
+  else if (reply.status == -1)
+    {
+      /* the worker refused the job before running it: run it here */
+      free_unit(u);
+      launch_command(job, job->command);
+      return;
+    }
+  else
+    {
+      w->jobs++;
+      w->utime_usec += reply.utime_usec;
+      w->stime_usec += reply.stime_usec;
+    }
+  free_unit(u);
+  finish_job(job, reply.status);
+}
+
+/* reap every exited child reported by the SIGCHLD signalfd */
+static void
+reap_sigchld(void)
+{
+  struct signalfd_siginfo si;
+  pid_t pid;
+  int status;
+  job_unit_t u;
+
+  while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si))
+    continue;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    for (u = running_units; u; u = u->next)
+      if (u->pid == pid)
+	{
+	  finish_unit(u, exit_status(status));
+	  break;
+	}
+}
+
+/* handle completions; wait at most TIMEOUT ms (-1: until one arrives) */
+static void
+run_event_loop(int timeout)
+{
+  struct epoll_event events[64];
+  int i, n;
+
+  n = epoll_wait(epoll_fd, events, 64, timeout);
+  if (n == -1 && errno != EINTR)
+    error(1, errno, "epoll_wait");
+
+  for (i = 0; i < n; i++)
+    {
+      job_unit_t u = (job_unit_t) events[i].data.ptr;
+      int status;
+      if (u == NULL)
+	reap_sigchld();
+      else if (u->worker)
+	finish_remote_unit(u);
+      else if (waitpid(u->pid, &status, 0) == u->pid)
+	finish_unit(u, exit_status(status));
+    }
+}
+
 /*lab 1c: parallel execution*/
 int
 execute_command_timetravel(command_t c)
@@ -427,62 +1544,71 @@ execute_command_timetravel(command_t c)
     {
       file_usage_stat_all = make_file_usage_list();
     }
+  init_event_loop();
 
   // treat a sequence command as two separate command
   // there is a chance of paralism between the two subcommands
   if (c->type == SEQUENCE_COMMAND) 
     {
+      c->status = -1;	// resolved from the second command when asked
       execute_command_timetravel(c->u.command[0]);
       execute_command_timetravel(c->u.command[1]);
       /* at this stage, two subcommands already be sent
-         to execute_command_standard(), we simply go for
-         the next command */
+         to the scheduler, we simply go for the next command */
       return 0;
     }
 
-  //file_dependency lists all files that this command depends on, together with corresponding processes  
+  //file_dependency lists all files that this command depends on, together with the jobs using them
   file_usage_list_t file_dependency = make_file_usage_list();
   check_command_file_dependency(c, file_dependency);
 
-  pid_t pid;
-  while ((pid = fork()) < 0);	//wait until we can create a process
-  if (pid == 0)
+  job_t job = (job_t) checked_malloc(sizeof(struct job));
+  job->command = c;
+  job->ndeps = 0;
+  job->done = false;
+  job->dependents = NULL;
+  c->status = -1;
+
+  file_usage_t f;
+  for (f = file_dependency->head; f; f = f->next)
     {
-      file_usage_t f = file_dependency->head;
-      while (f)
+      job_t pre = f->jobs->head->job;
+      if (pre && !pre->done)
 	{
-	  pid_t pre_pid = f->pids->head->pid;
-	  if (pre_pid != 0)
-	    {
-	      //printf("Waiting for %d\n",f->pid);
-	      //int status;
-	      //waitpid(f->pid, &status, 0);	//child cannot wait for another child, so waitpid does not wait
-	      while(kill(pre_pid,0)!=-1);	//wait for a non-child process
-	    }
-	  f = f->next;	//goto next
+	  struct job_ref *r = (struct job_ref *) checked_malloc(sizeof(struct job_ref));
+	  r->job = job;
+	  r->next = pre->dependents;
+	  pre->dependents = r;
+	  job->ndeps++;
 	}
-      //printf("Executing ");
-      //print_command(c);
-      execute_command_standard(c);
-      _exit(command_status(c));
+      try_add_file_usage(file_usage_stat_all, job, f->key, f->jobs->head->mode);
     }
-  else if (pid > 0)
-    {
-      //printf("pid=%d ", pid);
-      //print_command(c);
-      file_usage_t f = file_dependency->head;
 
-      while (f)
-	{
-	  try_add_file_usage(file_usage_stat_all, pid, f->file_name, f->pids->head->mode);
-	  f = f->next;
-	}
-      //int status;
-      //waitpid(pid,&status,0);
-    }
+  jobs_pending++;
+
+  if (job->ndeps == 0)
+    launch_job(job);
+
+  /* pick up completions that are already in, so their dependents
+     start while we are still reading the script */
+  run_event_loop(0);
   return 0;
 }
 
+void
+wait_all_commands (void)
+{
+  struct worker *w;
+
+  while (jobs_pending > 0)
+    run_event_loop(-1);
+
+  if (worker_stats)
+    for (w = workers; w; w = w->next)
+      fprintf(stderr, "worker %s: %d jobs, %.3fs user, %.3fs sys\n",
+	      w->path, w->jobs, w->utime_usec / 1e6, w->stime_usec / 1e6);
+}
+
 void
 execute_command (command_t c, bool time_travel)
 {
@@ -18,7 +18,7 @@ static char const *script_name;
 static void
 usage (void)
 {
-  error (1, 0, "usage: %s [-pt] SCRIPT-FILE", program_name);
+  error (1, 0, "usage: %s [-apstv] [-w WORKER-SOCKET]... SCRIPT-FILE", program_name);
 }
 
 static int
@@ -36,10 +36,14 @@ main (int argc, char **argv)
   program_name = argv[0];
 
   for (;;)
-    switch (getopt (argc, argv, "pt"))
+    switch (getopt (argc, argv, "apstvw:"))
       {
+      case 'a': set_pipe_affinity (true); break;
       case 'p': print_tree = true; break;
+      case 's': set_speculation (true); break;
       case 't': time_travel = true; break;
+      case 'v': set_worker_stats (true); break;
+      case 'w': add_worker (optarg); break;
       default: usage (); break;
       case -1: goto options_exhausted;
       }
@@ -77,12 +81,7 @@ main (int argc, char **argv)
 	}
     }
 
-  int status;
-  while(waitpid(-1, &status, 0))	//wait until all children exit
-  {
-	if(errno==ECHILD)
-          break;
-  }
-	
+  wait_all_commands ();
+
   return print_tree || !last_command ? 0 : command_status (last_command);
 }
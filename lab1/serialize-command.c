@@ -0,0 +1,216 @@
+// UCLA CS 111 Lab 1 command serialization, for shipping commands to workers
+
+#include "command.h"
+#include "command-internals.h"
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A command is written in preorder.  Each node starts with its type
+   byte (NO_COMMAND for a missing subcommand), then its input and
+   output redirections, then its payload: two subcommands, one
+   subshell command, or a word count followed by the words.  Strings
+   are a 32-bit length (NO_STRING for null) followed by the bytes.  */
+
+#define NO_COMMAND 0xff
+#define NO_STRING UINT32_MAX
+
+struct buffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+static void
+put_bytes (struct buffer *b, void const *p, size_t n)
+{
+  while (b->size < b->len + n)
+    b->data = checked_grow_alloc (b->data, &b->size);
+  memcpy (b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void
+put_u32 (struct buffer *b, uint32_t v)
+{
+  put_bytes (b, &v, sizeof v);
+}
+
+static void
+put_string (struct buffer *b, char const *s)
+{
+  if (!s)
+    {
+      put_u32 (b, NO_STRING);
+      return;
+    }
+  uint32_t n = strlen (s);
+  put_u32 (b, n);
+  put_bytes (b, s, n);
+}
+
+static void
+put_command (struct buffer *b, command_t c)
+{
+  unsigned char type = c ? c->type : NO_COMMAND;
+  put_bytes (b, &type, 1);
+  if (!c)
+    return;
+
+  put_string (b, c->input);
+  put_string (b, c->output);
+  switch (c->type)
+    {
+    case AND_COMMAND:
+    case SEQUENCE_COMMAND:
+    case OR_COMMAND:
+    case PIPE_COMMAND:
+      put_command (b, c->u.command[0]);
+      put_command (b, c->u.command[1]);
+      break;
+
+    case SIMPLE_COMMAND:
+      {
+	uint32_t n = 0;
+	char **w;
+	for (w = c->u.word; *w; w++)
+	  n++;
+	put_u32 (b, n);
+	for (w = c->u.word; *w; w++)
+	  put_string (b, *w);
+	break;
+      }
+
+    case SUBSHELL_COMMAND:
+      put_command (b, c->u.subshell_command);
+      break;
+    }
+}
+
+size_t
+serialize_command (command_t c, char **buf)
+{
+  struct buffer b;
+  b.size = 256;
+  b.len = 0;
+  b.data = checked_malloc (b.size);
+  put_command (&b, c);
+  *buf = b.data;
+  return b.len;
+}
+
+/* Reading side: P walks from the start of the buffer to END, and any
+   read past END marks the whole message as malformed.  */
+struct reader
+{
+  char const *p;
+  char const *end;
+  bool bad;
+};
+
+static bool
+get_bytes (struct reader *r, void *p, size_t n)
+{
+  if (r->bad || (size_t) (r->end - r->p) < n)
+    {
+      r->bad = true;
+      return false;
+    }
+  memcpy (p, r->p, n);
+  r->p += n;
+  return true;
+}
+
+static uint32_t
+get_u32 (struct reader *r)
+{
+  uint32_t v = 0;
+  get_bytes (r, &v, sizeof v);
+  return v;
+}
+
+static char *
+get_string (struct reader *r)
+{
+  uint32_t n = get_u32 (r);
+  if (r->bad || n == NO_STRING)
+    return NULL;
+  if ((size_t) (r->end - r->p) < n)
+    {
+      r->bad = true;
+      return NULL;
+    }
+  char *s = checked_malloc (n + 1);
+  memcpy (s, r->p, n);
+  s[n] = '\0';
+  r->p += n;
+  return s;
+}
+
+static command_t
+get_command (struct reader *r)
+{
+  unsigned char type;
+  if (!get_bytes (r, &type, 1) || type == NO_COMMAND)
+    return NULL;
+  if (type > SUBSHELL_COMMAND)
+    {
+      r->bad = true;
+      return NULL;
+    }
+
+  command_t c = checked_malloc (sizeof *c);
+  c->type = type;
+  c->status = -1;
+  c->input = get_string (r);
+  c->output = get_string (r);
+  switch (c->type)
+    {
+    case AND_COMMAND:
+    case SEQUENCE_COMMAND:
+    case OR_COMMAND:
+    case PIPE_COMMAND:
+      c->u.command[0] = get_command (r);
+      c->u.command[1] = get_command (r);
+      break;
+
+    case SIMPLE_COMMAND:
+      {
+	uint32_t i, n = get_u32 (r);
+	if (r->bad || n == 0 || n > (size_t) (r->end - r->p) / sizeof n)
+	  {
+	    r->bad = true;
+	    c->u.word = NULL;
+	    break;
+	  }
+	c->u.word = checked_malloc ((n + 1) * sizeof *c->u.word);
+	for (i = 0; i < n; i++)
+	  if (!(c->u.word[i] = get_string (r)))
+	    r->bad = true;
+	c->u.word[n] = NULL;
+	break;
+      }
+
+    case SUBSHELL_COMMAND:
+      if (!(c->u.subshell_command = get_command (r)))
+	r->bad = true;
+      break;
+    }
+  return c;
+}
+
+command_t
+deserialize_command (char const *buf, size_t len)
+{
+  struct reader r;
+  r.p = buf;
+  r.end = buf + len;
+  r.bad = false;
+  command_t c = get_command (&r);
+  /* The commands are short-lived in the worker, so a malformed
+     message simply leaks what was built so far.  */
+  return r.bad || r.p != r.end ? NULL : c;
+}
@@ -0,0 +1,63 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that speculative && and || commit the
+# right-hand side's output only when it would have run.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+echo orig >real
+chmod 600 real
+ln -s real lnk
+
+cat >test.sh <<'EOF'
+(sleep 2; true) && (echo kept; ls /nonexistent-kept; sleep 2) </dev/null >a
+(sleep 1; false) && (echo dropped; ls /nonexistent-dropped; sleep 5) </dev/null >b
+true || echo dropped </dev/null >c
+false || echo kept </dev/null >d
+(sleep 1; false) && cat >f
+cat >g
+true && echo new </dev/null >lnk
+echo old > e
+false && echo new </dev/null >e
+EOF
+
+cat >test.exp <<'EOF'
+kept
+kept
+input
+new
+old
+EOF
+
+start=$(date +%s)
+echo input | ../timetrash -s test.sh >test.out 2>test.err
+test $? = 1 || exit
+end=$(date +%s)
+
+# The first command overlaps its halves; the second must not wait
+# for the killed right-hand side.
+test $((end - start)) -lt 6 || {
+  echo "speculation took $((end - start))s"
+  exit 1
+}
+
+# A right-hand side that reads the shell's stdin is not started early,
+# only the committed side's stderr is shown, and a symlinked target is
+# written through.
+test ! -e b && test ! -e c && test ! -e f || exit
+test -L lnk && test "$(stat -c %a real)" = 600 || exit
+cat a d g real e >test.out
+diff -u test.exp test.out || exit
+grep -q nonexistent-kept test.err && test "$(wc -l <test.err)" = 1 || {
+  cat test.err
+  exit 1
+}
+test "$(ls -A | grep spec-)" = "" || exit
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,52 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that time travel keeps the order of commands
+# that share a redirection file, however the file name is spelled.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+mkdir dir || exit
+
+cat >test.sh <<'EOF'
+(sleep 1; echo one) > ./x
+cat < dir/../x > y1
+(sleep 1; echo two) > x
+cat < .//dir/./../x > y2
+EOF
+
+cat >test.exp <<'EOF'
+one
+two
+EOF
+
+../timetrash -t test.sh >test.err 2>&1 || exit
+cat y1 y2 >test.out
+
+diff -u test.exp test.out || exit
+test ! -s test.err || {
+  cat test.err
+  exit 1
+}
+
+# The exit status is that of the last command, even though it may
+# finish before the commands ahead of it.
+printf '(sleep 1; true)\nfalse\n' >status1.sh
+printf 'sleep 1 > z\ntrue\n' >status2.sh
+../timetrash -t status1.sh && exit 1
+../timetrash -t status2.sh || exit
+
+# && and || are decided by timetrash itself as each side exits: the
+# commands of a job are its own children, not a job process's.
+echo 'echo $PPID' >ppid.sh
+printf '%s\n' '(sleep 1; false) && echo no > n || sh ppid.sh > p' \
+  'true && (false || echo yes) > y; false' >andor.sh
+../timetrash -t andor.sh & pid=$!
+wait $pid && exit 1
+test ! -e n && test yes = "$(cat y)" && test $pid = "$(cat p)" || exit
+
+) || exit
+
+rm -fr "$tmp"
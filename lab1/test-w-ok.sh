@@ -0,0 +1,61 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test time travel with several local workers.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+for w in 1 2 3; do
+  ../timetrash-worker w$w.sock >worker$w.out 2>&1 &
+  echo $! >>workers.pid
+done
+trap 'kill $(cat workers.pid) 2>/dev/null' 0
+for w in 1 2 3; do
+  until test -S w$w.sock; do sleep 0.1; done
+done
+
+cat >test.sh <<'EOF'
+(sleep 1; echo a) > a
+(sleep 1; echo b) > b
+(sleep 1; echo c) > c
+(cat; cat < b) < a > ab
+(cat; cat < c) < ./ab > abc
+printenv GREETING > g
+echo out-from-job
+tr a-z A-Z > up
+EOF
+
+cat >test.exp <<'EOF'
+a
+b
+c
+EOF
+
+start=$(date +%s)
+echo in-from-client | GREETING=hello ../timetrash -t -v -w w1.sock -w w2.sock -w w3.sock \
+  test.sh >test.out 2>test.err
+test $? = 0 || exit
+end=$(date +%s)
+
+# The three sleeps are independent and land on different workers.
+test $((end - start)) -lt 3 || {
+  echo "workers took $((end - start))s"
+  exit 1
+}
+diff -u test.exp abc || exit
+echo hello | diff -u - g || exit
+# Jobs use the client's stdin and stdout, not the worker's.
+echo out-from-job | diff -u - test.out || exit
+echo IN-FROM-CLIENT | diff -u - up || exit
+test ! -s worker1.out && test ! -s worker2.out && test ! -s worker3.out || exit
+grep -c ': [1-9][0-9]* jobs' test.err | grep -qx 3 || {
+  cat test.err
+  exit 1
+}
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,159 @@
+// UCLA CS 111 Lab 1 time-travel worker daemon
+
+#include "command.h"
+#include "worker.h"
+
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* Refuse requests larger than this; they cannot come from a script.  */
+#define MAX_REQUEST_PART (64 << 20)
+
+static char const *program_name;
+static char const *socket_path;
+
+static void
+usage (void)
+{
+  error (1, 0, "usage: %s SOCKET", program_name);
+}
+
+static void
+remove_socket (int sig)
+{
+  unlink (socket_path);
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+static char *
+read_part (int fd, uint32_t len)
+{
+  char *buf;
+  if (len > MAX_REQUEST_PART || !(buf = malloc (len + 1)))
+    return NULL;
+  if (!read_full (fd, buf, len))
+    {
+      free (buf);
+      return NULL;
+    }
+  buf[len] = '\0';
+  return buf;
+}
+
+static int64_t
+usec (struct timeval tv)
+{
+  return tv.tv_sec * (int64_t) 1000000 + tv.tv_usec;
+}
+
+/* Run the one job sent over connection FD and send back its reply.  */
+static void
+serve (int fd)
+{
+  struct worker_request req;
+  struct worker_reply reply;
+  struct rusage ru;
+  char *cwd = NULL, *env = NULL, *cmd = NULL, *e;
+  command_t c = NULL;
+  int fds[WORKER_NFDS], i;
+
+  memset (&reply, 0, sizeof reply);
+  reply.status = -1;
+
+  if (read_full_fds (fd, &req, sizeof req, fds)
+      && req.magic == WORKER_MAGIC
+      && (cwd = read_part (fd, req.cwd_len))
+      && (env = read_part (fd, req.env_len))
+      && (cmd = read_part (fd, req.command_len))
+      && (c = deserialize_command (cmd, req.command_len))
+      && (!*cwd || chdir (cwd) == 0))
+    {
+      /* The job sees the client's environment, not ours.  */
+      clearenv ();
+      for (e = env; e < env + req.env_len; e += strlen (e) + 1)
+	putenv (e);
+
+      /* ... and reads and writes the client's stdin, stdout and
+	 stderr, not ours.  */
+      for (i = 0; i < WORKER_NFDS; i++)
+	if (dup2 (fds[i], i) == -1)
+	  error (1, errno, "dup2");
+
+      execute_command (c, false);
+      reply.status = command_status (c);
+
+      getrusage (RUSAGE_CHILDREN, &ru);
+      reply.utime_usec = usec (ru.ru_utime);
+      reply.stime_usec = usec (ru.ru_stime);
+      reply.maxrss_kb = ru.ru_maxrss;
+    }
+
+  write_full (fd, &reply, sizeof reply);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  int listen_fd;
+
+  program_name = argv[0];
+  if (argc != 2)
+    usage ();
+  socket_path = argv[1];
+  if (strlen (socket_path) >= sizeof addr.sun_path)
+    error (1, 0, "%s: socket path too long", socket_path);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1)
+    error (1, errno, "socket");
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+  unlink (socket_path);
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1)
+    error (1, errno, "%s", socket_path);
+  if (listen (listen_fd, SOMAXCONN) == -1)
+    error (1, errno, "listen");
+
+  signal (SIGINT, remove_socket);
+  signal (SIGTERM, remove_socket);
+  signal (SIGCHLD, SIG_IGN);	// connection handlers reap themselves
+
+  for (;;)
+    {
+      int fd = accept (listen_fd, NULL, NULL);
+      pid_t pid;
+      if (fd == -1)
+	{
+	  if (errno != EINTR && errno != ECONNABORTED)
+	    error (0, errno, "accept");
+	  continue;
+	}
+
+      while ((pid = fork ()) < 0);
+      if (pid == 0)
+	{
+	  /* the job's own commands must be waitable again */
+	  signal (SIGCHLD, SIG_DFL);
+	  signal (SIGINT, SIG_DFL);
+	  signal (SIGTERM, SIG_DFL);
+	  close (listen_fd);
+	  serve (fd);
+	  _exit (0);
+	}
+      close (fd);
+    }
+}
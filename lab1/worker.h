@@ -0,0 +1,41 @@
+// UCLA CS 111 Lab 1 time-travel worker protocol
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A client connects to a worker's Unix socket once per job.  It sends
+   a request header followed by the job's working directory, its
+   environment as NUL-terminated "NAME=VALUE" strings, and the command
+   as written by serialize_command.  The header carries the client's
+   stdin, stdout and stderr as SCM_RIGHTS ancillary data, and the job
+   runs with them.  The worker runs the command and answers with a
+   reply, then closes the connection.  */
+
+#define WORKER_MAGIC 0x54545731	// "TTW1"
+#define WORKER_NFDS 3		// stdin, stdout, stderr
+
+struct worker_request
+{
+  uint32_t magic;
+  uint32_t cwd_len;
+  uint32_t env_len;
+  uint32_t command_len;
+};
+
+struct worker_reply
+{
+  int32_t status;		// exit status, or -1 if the job never ran
+  int64_t utime_usec;		// cpu time used by the job's processes
+  int64_t stime_usec;
+  int64_t maxrss_kb;
+};
+
+/* Write or read exactly N bytes; return false on error or EOF.  */
+bool write_full (int fd, void const *buf, size_t n);
+bool read_full (int fd, void *buf, size_t n);
+
+/* Like write_full and read_full, but also pass the WORKER_NFDS file
+   descriptors in FDS along with the data.  */
+bool write_full_fds (int fd, void const *buf, size_t n, int const *fds);
+bool read_full_fds (int fd, void *buf, size_t n, int *fds);
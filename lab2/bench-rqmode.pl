@@ -0,0 +1,65 @@
+#! /usr/bin/perl -w
+
+# Compare the request-queue path (use_bio=0) with the bio path
+# (use_bio=1) at 4K random I/O.  Run inside Qemu as root, after
+# building osprd.ko; it reloads the module once per mode.
+#
+# Usage: perl bench-rqmode.pl [NPROCS] [NOPS]
+#   NPROCS processes (default 4) each write, then read, NOPS random
+#   4K blocks (default: the whole disk between them) of
+#   /dev/osprda, the same way osprdaccess does: open(O_SYNC), lseek,
+#   read/write.  Buffers are flushed between the phases so that every
+#   read reaches the driver.
+
+use Fcntl qw(O_RDWR O_SYNC SEEK_SET);
+use Time::HiRes qw(time);
+
+my($bs) = 4096;
+my($nsectors) = 65536;			# a 32 MB disk
+my($nblocks) = $nsectors * 512 / $bs;
+my($nprocs) = @ARGV > 0 ? $ARGV[0] : 4;
+my($nops) = @ARGV > 1 ? $ARGV[1] : int($nblocks / $nprocs);
+my($disk) = "/dev/osprda";
+
+sub run_phase ($) {
+    my($write) = @_;
+    my($start) = time;
+    for (my $p = 0; $p < $nprocs; $p++) {
+	next if fork;
+	srand($$);
+	sysopen(DEV, $disk, O_RDWR | O_SYNC) || die "$disk: $!";
+	my($buf) = "x" x $bs;
+	# each process covers its own share of the blocks once, in random
+	# order, so reads never hit the buffer cache
+	my(@blocks) = map { $_ * $nprocs + $p } 0 .. $nops - 1;
+	for (my $i = @blocks - 1; $i > 0; $i--) {
+	    my($j) = int(rand($i + 1));
+	    @blocks[$i, $j] = @blocks[$j, $i];
+	}
+	foreach my $b (@blocks) {
+	    sysseek(DEV, ($b % $nblocks) * $bs, SEEK_SET) || die "lseek: $!";
+	    if ($write) {
+		syswrite(DEV, $buf, $bs) == $bs || die "write: $!";
+	    } else {
+		sysread(DEV, $buf, $bs) == $bs || die "read: $!";
+	    }
+	}
+	exit(0);
+    }
+    1 while wait != -1;
+    return time - $start;
+}
+
+foreach my $mode (0, 1) {
+    system("rmmod osprd 2>/dev/null");
+    system("insmod osprd.ko nsectors=$nsectors use_bio=$mode") == 0
+	|| die "insmod failed";
+    system("./create-devs") == 0 || die "create-devs failed";
+
+    my($ops) = $nprocs * $nops;
+    my($wt) = run_phase(1);
+    system("blockdev --flushbufs $disk");
+    my($rt) = run_phase(0);
+    printf("use_bio=%d: write %8.0f IOPS  read %8.0f IOPS\n",
+	   $mode, $ops / $wt, $ops / $rt);
+}
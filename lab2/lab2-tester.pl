@@ -166,6 +166,181 @@ close FOO;
       ') 2>/dev/null',
       "aX"
     ],
+
+# multi-segment requests
+    # 18
+    [ 'yes 0123456789abcdef | head -c 16384 > /tmp/osprd-pattern ; ' .
+      './osprdaccess -w 16384 < /tmp/osprd-pattern && ' .
+      './osprdaccess -r 16384 | cmp - /tmp/osprd-pattern && echo same ; ' .
+      'rm -f /tmp/osprd-pattern',
+      "same"
+    ],
+
+# range locks on disjoint sectors don't block each other
+    # 19
+    [ '(echo aaa | ./osprdaccess -w 3 -lr -d 0.4) & ' .
+      '(sleep 0.1 ; echo bbb | ./osprdaccess -w 3 -o 512 -Lr) ; ' .
+      '(sleep 0.1 ; echo ccc | ./osprdaccess -w 3 -o 2 -Lr) ; ' .
+      'sleep 0.5 ; ./osprdaccess -r 3 ; ./osprdaccess -r 3 -o 512',
+      "ioctl OSPRDIOCTRYACQUIRERANGE: Device or resource busy aaabbb"
+    ],
+
+# ramdisks created at run time
+    # 20
+    [ 'dev=`./osprdctl create 64` && ' .
+      '(echo scratch | ./osprdaccess -w 8 $dev) && ' .
+      './osprdaccess -r 8 $dev && ' .
+      '(./osprdaccess -r 1 -d 0.4 $dev >/dev/null &) ; ' .
+      'sleep 0.2 ; ./osprdctl destroy $dev ; ' .
+      'sleep 0.4 ; ./osprdctl destroy $dev && test ! -e $dev && echo gone',
+      "scratch ioctl OSPRDCTLDESTROY: Device or resource busy gone"
+    ],
+
+# same-filled pages read back intact; /proc/driver/osprd lists the disks
+    # 21
+    [ 'head -c 8192 /dev/zero | tr "\\0" x | ./osprdaccess -w 8192 -o 100 && ' .
+      './osprdaccess -r 8192 -o 100 | tr -d x | wc -c ; ' .
+      'grep -c "^osprda: " /proc/driver/osprd',
+      "0 1"
+    ],
+
+# an asynchronous acquire is granted in order, and poll() sees it
+    # 22
+    [ '(echo foo | ./osprdaccess -w 3 -l -d 0.4) & ' .
+      'sleep 0.1 ; ./osprdaccess -r 3 -la',
+      "foo"
+    ],
+
+# several ramdisks locked in one call: all or nothing
+    # 23
+    [ '(./osprdaccess -w 0 -lv /dev/osprda -d 0.5 /dev/osprdb < /dev/null) & ' .
+      'sleep 0.1 ; ./osprdaccess -r 0 -Lv /dev/osprdc /dev/osprdb ; ' .
+      './osprdaccess -r 0 -lv /dev/osprdb /dev/osprda && echo done',
+      "ioctl OSPRDIOCTRYACQUIREVEC: Device or resource busy done"
+    ],
+
+# an upgraded read lock excludes readers; a downgraded write lock doesn't
+    # 24
+    [ '(./osprdaccess -r 0 -l -u -d 0.4 &) ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 0 -L ; sleep 0.3 ; ' .
+      '(./osprdaccess -w 0 -l -D -d 0.4 < /dev/null &) ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 0 -L && echo shared ; sleep 0.3',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy shared"
+    ],
+
+# lock statistics are listed per disk
+    # 25
+    [ './osprdaccess -r 0 -l ; ' .
+      'grep -c "^osprda: [0-9]* acquires" /proc/driver/osprd_locks ; ' .
+      'grep -A3 "^osprda: " /proc/driver/osprd_locks | grep -c "^ *hold_us"',
+      "1 1"
+    ],
+
+# the benchmark mode reports reads and writes separately
+    # 26
+    [ './osprdaccess -b -t 0.2 -rand -write 50 -j 2 -lock | ' .
+      'grep -c "^\\(read\\|write\\): .* IOPS.* p99 "',
+      "2"
+    ],
+
+# memory can be mapped only under the lock
+    # 27
+    [ 'echo foo | ./osprdaccess -w 3 -m -l ; ' .
+      './osprdaccess -r 3 -m -l ; echo ; ' .
+      './osprdaccess -r 3 -m',
+      "foo mmap: Permission denied"
+    ],
+
+# waiting for each other's range locks is a deadlock
+    # 28
+    [ '(./osprdaccess -w 512 -lr -d 0.3 /dev/osprda ' .
+      '-o 512 -lr -d 0 /dev/osprda < /dev/null && echo granted) & ' .
+      'sleep 0.1 ; ./osprdaccess -w 512 -o 512 -lr -d 0.3 /dev/osprda ' .
+      '-o 0 -lr -d 0 /dev/osprda < /dev/null ; wait',
+      "ioctl OSPRDIOCACQUIRERANGE: Resource deadlock avoided granted"
+    ],
+
+# the whole-device lock and range locks exclude each other
+    # 29
+    [ '(./osprdaccess -w 0 -l -d 0.4 < /dev/null &) ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 512 -Lr ; sleep 0.4 ; ' .
+      '(echo x | ./osprdaccess -w 1 -lr -d 0.4 &) ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 0 -L',
+      "ioctl OSPRDIOCTRYACQUIRERANGE: Device or resource busy " .
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy"
+    ],
+
+# a second read lock by one process is a deadlock on the fast path too
+    # 30
+    [ './osprdaccess -r 0 -l /dev/osprda -l /dev/osprda ; ' .
+      './osprdaccess -r 0 -l /dev/osprda -L /dev/osprda',
+      "ioctl OSPRDIOCACQUIRE: Resource deadlock avoided " .
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy"
+    ],
+
+# the compressed store round-trips text, same-filled and random pages
+    # 31
+    [ 'rmmod osprd && insmod osprd.ko compress=1 && ' .
+      'head -c 4096 /dev/urandom > rand.tmp && ' .
+      '(seq 2000 | head -c 4096 ; head -c 4096 /dev/zero | tr "\\0" x ; ' .
+      'cat rand.tmp) > pages.tmp && ' .
+      './osprdaccess -w 12288 < pages.tmp && ' .
+      './osprdaccess -r 12288 | cmp - pages.tmp && echo same ; ' .
+      'awk \'/^osprda: / { print $4, $5, $6, $7, $8, $9, ' .
+      '($12 < $8 ? "smaller" : "larger") }\' /proc/driver/osprd ; ' .
+      'rm -f rand.tmp pages.tmp ; rmmod osprd ; insmod osprd.ko ; ./create-devs',
+      "same 3 pages (1 same-filled), 12 KB smaller"
+    ],
+
+# snapshots, and snapshots of snapshots, keep their own copies
+    # 32
+    [ 'rmmod osprd && insmod osprd.ko sparse=1 && ./create-devs && ' .
+      '(echo old | ./osprdaccess -w) && ' .
+      '(echo low | ./osprdaccess -w -o 4096) && ' .
+      's1=`./osprdctl snapshot /dev/osprda` && ' .
+      '(echo src | ./osprdaccess -w) && ' .
+      '(echo one | ./osprdaccess -w $s1) && ' .
+      's2=`./osprdctl snapshot $s1` && ' .
+      '(echo two | ./osprdaccess -w $s2) && ' .
+      './osprdaccess -w 4096 -o 4096 -z $s2 && ' .
+      'for dev in /dev/osprda $s1 $s2 ; do ' .
+      './osprdaccess -r 4 $dev ; ' .
+      './osprdaccess -r 4 -o 4096 $dev | tr "\\0" 0 ; echo ; done ; ' .
+      './osprdctl destroy $s2 ; ./osprdctl destroy $s1 ; ' .
+      'rmmod osprd ; insmod osprd.ko ; ./create-devs',
+      "src low one low two 0000"
+    ],
+
+# a backed disk keeps its contents across a reload, and can't be
+# snapshotted
+    # 33
+    [ 'rm -rf backing.tmp && mkdir backing.tmp && ' .
+      'rmmod osprd && insmod osprd.ko backing=`pwd`/backing.tmp && ' .
+      './create-devs && (echo kept | ./osprdaccess -w -o 5000) && ' .
+      'rmmod osprd && insmod osprd.ko sparse=1 backing=`pwd`/backing.tmp && ' .
+      './create-devs && ./osprdaccess -r 5 -o 5000 && ' .
+      './osprdctl snapshot /dev/osprda ; ' .
+      'rmmod osprd ; insmod osprd.ko ; ./create-devs ; rm -rf backing.tmp',
+      "kept ioctl OSPRDIOCSNAPSHOT: Operation not supported"
+    ],
+
+# without the downgrade, the same write lock keeps the reader out
+    # 34
+    [ '(./osprdaccess -w 0 -l -d 0.4 < /dev/null &) ; ' .
+      'sleep 0.2 ; ./osprdaccess -r 0 -L && echo shared ; sleep 0.3',
+      "ioctl OSPRDIOCTRYACQUIRE: Device or resource busy"
+    ],
+
+# a destroyed disk's minor number is free again, for a fresh disk, as
+# soon as destroy returns
+    # 35
+    [ 'dev=`./osprdctl create 64` && ' .
+      '(echo old | ./osprdaccess -w 3 $dev) && ' .
+      './osprdctl destroy $dev && new=`./osprdctl create 64` && ' .
+      'test $new = $dev && ./osprdaccess -r 3 $new | tr "\\0" z && ' .
+      './osprdctl destroy $new && echo gone',
+      "zzz gone"
+    ],
     );
 
 my($ntest) = 0;
@@ -13,9 +13,24 @@
 #include <linux/blkdev.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/zlib.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/poll.h>
+#include <asm/uaccess.h>
 
 #include "spinlock.h"
 #include "osprd.h"
+#include "osprdlock.h"
 
 /* The size of an OSPRD sector. */
 #define SECTOR_SIZE	512
@@ -24,6 +39,14 @@
  * is locked. */
 #define F_OSPRD_LOCKED	0x80000
 
+/* Added along with F_OSPRD_LOCKED when the lock is a write lock.  This is
+ * usually so just when the file is open for writing, but
+ * OSPRDIOCUPGRADE and OSPRDIOCDOWNGRADE change it. */
+#define F_OSPRD_WRITE_LOCKED	0x100000
+
+#define osprd_lock_flags(writable) \
+	(F_OSPRD_LOCKED | ((writable) ? F_OSPRD_WRITE_LOCKED : 0))
+
 /* eprintk() prints messages to the console.
  * (If working on a real Linux machine, change KERN_NOTICE to KERN_ALERT or
  * KERN_EMERG so that you are sure to see the messages.  By default, the
@@ -44,57 +67,176 @@ MODULE_AUTHOR("Skeletor");
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
-struct pid_node {
-	int pid;
-	unsigned ticket;
-	struct pid_node *next;
-	struct pid_node *prev;
+/* This many disks are created when the module is loaded.  More can be
+ * created, with their own sizes, and destroyed at run time through the
+ * /dev/osprdctl control device (see osprd.h), up to OSPRD_MAX_DEVICES. */
+static int ndevices = 16;
+module_param(ndevices, int, 0);
+
+#define OSPRD_MAX_DEVICES	256	// one minor number each
+
+/* This module parameter selects how I/O reaches the driver.  By default
+ * the block layer queues requests, and its elevator merges and sorts
+ * them before osprd_process_request sees them.  With
+ * "insmod osprd.ko use_bio=1", each bio is handed to osprd_make_request
+ * as soon as it is submitted; for a RAM disk the elevator buys nothing. */
+static int use_bio = 0;
+module_param(use_bio, int, 0);
+
+/* This module parameter makes the backing store sparse.  Instead of
+ * vmallocing the whole disk up front, each device keeps a radix tree of
+ * pages that are allocated on first write; reading a page that was never
+ * written returns zeros.  A mostly empty multi-GB ramdisk then costs
+ * only the pages actually written: "insmod osprd.ko sparse=1". */
+static int sparse = 0;
+module_param(sparse, int, 0);
+
+/* This module parameter compresses the sparse store, and implies it:
+ * "insmod osprd.ko compress=1".  Each page is deflated as it is written
+ * and inflated as it is read.  A page filled with one repeated word is
+ * kept as just that word, and a zero page is not kept at all.  Each
+ * disk's compression ratio is shown in /proc/driver/osprd. */
+static int compress = 0;
+module_param(compress, int, 0);
+
+/* This module parameter keeps the disks' contents across reloads:
+ * "insmod osprd.ko backing=/var/lib/osprd" backs each disk made at load
+ * time with a file of its name in that directory (/var/lib/osprd/osprda
+ * and so on).  Pages are read in from the file the first time they are
+ * used, and changed pages are written back every few seconds by a
+ * kernel thread, and when the disk goes away.  Backed disks take bios
+ * directly, as with use_bio, since reading the file may sleep. */
+static char *backing = NULL;
+module_param(backing, charp, 0);
+
+#define OSPRD_FLUSH_INTERVAL	(5 * HZ)	// between write-backs
+#define OSPRD_FLUSH_BATCH	64		// most pages per file write
+
+/* Sectors per page of the sparse store. */
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - 9)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+#define osprd_npages(d) \
+	(((d)->nsectors + PAGE_SECTORS - 1) >> PAGE_SECTORS_SHIFT)
+
+/* A lock on sectors [start, end), either held or waited for.  Range locks
+ * are granted in arrival order among the locks they overlap: 'blockers'
+ * counts the conflicting locks that arrived earlier and are still there.
+ * The lock can be held once that drops to 0 and the whole-device lock
+ * isn't held in a conflicting mode (see range_device_ok). */
+typedef struct osprd_range_lock {
+	struct rb_node node;		// In 'd->range_locks', by 'start'
+	sector_t start;
+	sector_t end;
+	sector_t max_end;		// Largest 'end' in this subtree
+	unsigned ticket;		// Arrival order
+	unsigned blockers;
+	int writable;
+	int granted;			// Held, not waited for
+	pid_t pid;
+	struct file *filp;		// Released when this file is closed
+	struct osprd_waiter wait;	// In the wait-for graph until granted
+} osprd_range_lock_t;
+
+/* A frozen layer of the sparse store, shared by a disk and its snapshots
+ * (see osprd_snapshot).  Its pages never change again.  A page missing
+ * from a disk's own tree is looked up in its layers, newest first. */
+struct osprd_layer {
+	struct radix_tree_root pages;
+	struct osprd_layer *below;	// The next older layer, or NULL
+	atomic_t refs;			// Disks and layers on top of this
 };
-typedef struct pid_node*  pid_node_t;
 
-struct pid_list {
-	pid_node_t head;
-	pid_node_t tail;
+/* A page of the compressed store.  Its data is 'len' bytes of raw
+ * deflate output; or, if 'len' is PAGE_SIZE, the page itself, which
+ * didn't compress; or, if 'len' is 0, nothing: every word is 'fill'.
+ * Every page stored gets a new 'gen', so a writer can tell whether the
+ * page changed under it (see osprd_zstore). */
+struct osprd_zpage {
+	pgoff_t index;
+	unsigned len;
+	unsigned long fill;
+	unsigned long gen;
+	uint8_t data[0];
 };
 
-struct ticket_queue_node {
-	unsigned ticket;
-	struct ticket_queue_node *next;
+/* Each CPU's room for (de)compressing one page of the compressed store.
+ * Compression runs outside 'page_lock', with preemption off so the CPU's
+ * buffers and streams are ours alone. */
+struct osprd_zscratch {
+	uint8_t page[PAGE_SIZE];	// The page being read or written
+	uint8_t in[PAGE_SIZE + 1];	// Its stored data, copied out
+	uint8_t out[PAGE_SIZE];		// Deflate output
+	z_stream def;			// Raw deflate and inflate streams
+	z_stream inf;
 };
-typedef struct ticket_queue_node* ticket_queue_node_t;
 
-struct ticket_queue {
-	struct ticket_queue_node *head;
+/* Read locks taken on the fast path (see osprd_read_lock_fast) are
+ * counted per CPU, so many readers don't fight over one cache line.
+ * Released holder nodes are kept for the next reader on the CPU, up to
+ * OSPRD_SPARE_READERS of them. */
+#define OSPRD_SPARE_READERS	8
+
+struct osprd_readers {
+	spinlock_t lock;
+	unsigned count;			// Fast read locks taken on this CPU
+	struct pid_list pids;		// and their holders
+	pid_node_t spare;		// Free holder nodes, linked by 'next'
+	unsigned nspare;
 };
-typedef struct ticket_queue* ticket_queue_t;
-
 
 
 /* The internal representation of our device. */
 typedef struct osprd_info {
+	sector_t nsectors;		// Size of this disk in sectors
+
 	uint8_t *data;                  // The data array. Its size is
 	                                // (nsectors * SECTOR_SIZE) bytes.
+					// NULL if the store is sparse.
+
+	struct radix_tree_root pages;	// Sparse store: written pages,
+					// indexed by sector / PAGE_SECTORS
+	spinlock_t page_lock;		// Protects 'pages' and 'base'
+	struct osprd_layer *base;	// Snapshot layers under 'pages'
+
+	struct osprd_zscratch *zscratch; // Compressed store: per-CPU
+					// scratch space, NULL if the store
+					// isn't compressed; then 'pages'
+					// holds osprd_zpages
+	unsigned long zgen;		// Last osprd_zpage 'gen' handed out.
+					// It and the following are under
+					// 'page_lock'.
+	unsigned long zpages;		// Pages stored,
+	unsigned long zsame;		//   how many are same-filled,
+	unsigned long zbytes;		//   and their total data size
+
+	struct file *backing_file;	// See 'backing'; NULL if none
+	unsigned long *loaded;		// Pages read in from it (bitmap)
+	unsigned long *dirty;		// Pages changed since written back
+	struct mutex fault_lock;	// Serializes reading pages in
+	uint8_t *fault_buf;		// A page being read in
+	uint8_t *flush_buf;		// OSPRD_FLUSH_BATCH pages being
+					// written back
+	struct task_struct *flusher;	// Writes back dirty pages
 
 	osp_spinlock_t mutex;           // Mutex for synchronizing access to
 					// this block device
 					// NOTE: this is NOT reader-writer lock
 					// only used for protecting internal variables
 
-	unsigned ticket_head;		// Currently running ticket for
-					// the device lock
+	struct osprd_lock lock;		// The device lock (see osprdlock.h)
+	wait_queue_head_t pollq;	// poll()ers waiting for an
+					// asynchronous acquire
+	atomic_t mapped;		// User mappings (see osprd_mmap)
 
-	unsigned ticket_tail;		// Next available ticket for
-					// the device lock
+	int reader_bias;		// Readers may use the fast path
+	struct osprd_readers *readers;	// Per-CPU fast-path read locks
 
-	wait_queue_head_t blockq;       // Wait queue for tasks blocked on
-					// the device lock
-
-	/* HINT: You may want to add additional fields to help
-	         in detecting deadlock. */
-	unsigned read_lock_cnt;
-	unsigned write_lock_cnt;
-	struct ticket_queue invalid_tickets;
-	struct pid_list locking_procs;
+	struct rb_root range_locks;	// Range locks, held or waited for.
+					// Changed under 'osprd_wfg_lock'
+					// too, for deadlock searches.
+	unsigned range_ticket;		// Next range-lock ticket
+	unsigned range_writers;		// Writable locks in 'range_locks'
+	wait_queue_head_t range_blockq;	// Tasks blocked on a range lock
 
 	// The following elements are used internally; you don't need
 	// to understand them.
@@ -102,183 +244,642 @@ typedef struct osprd_info {
 	spinlock_t qlock;		// Used internally for mutual
 	                                //   exclusion in the 'queue'.
 	struct gendisk *gd;             // The generic disk.
+	unsigned users;			// Open files, under osprd_devices_lock
+	int dying;			// Being destroyed, under osprd_devices_lock
 } osprd_info_t;
 
-#define NOSPRD 4
-static osprd_info_t osprds[NOSPRD];
+/* The disks, by minor number.  An entry only changes, and a disk is only
+ * opened or destroyed, with 'osprd_devices_lock' held.  A dying disk keeps
+ * its entry, so its minor number isn't handed out again, until it is
+ * completely torn down; nothing else may use it meanwhile. */
+static osprd_info_t *osprds[OSPRD_MAX_DEVICES];
+static DEFINE_MUTEX(osprd_devices_lock);
 
+// Declare useful helper functions
 
+/*
+ * file2osprd(filp)
+ *   Given an open file, check whether that file corresponds to an OSP ramdisk.
+ *   If so, return a pointer to the ramdisk's osprd_info_t.
+ *   If not, return NULL.
+ */
+static osprd_info_t *file2osprd(struct file *filp);
 
-void add_pid(struct pid_list *l, int pid, unsigned ticket) {
-	pid_node_t node = kmalloc(sizeof(struct pid_node), GFP_ATOMIC);
-	node->pid = pid;
-	node->ticket = ticket;
-	node->next = NULL;
-	node->prev = NULL;
-	if (l->head && l->tail) {
-		l->tail->next = node;
-		node->prev = l->tail;
-		l->tail = node;
-	} else {
-		l->head = node;
-		l->tail = node;
-	}
+/*
+ * for_each_open_file(task, callback, user_data)
+ *   Given a task, call the function 'callback' once for each of 'task's open
+ *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
+ *   the open file, and 'user_data' is copied from for_each_open_file's third
+ *   argument.
+ */
+static void for_each_open_file(struct task_struct *task,
+			       void (*callback)(struct file *filp,
+						osprd_info_t *user_data),
+			       osprd_info_t *user_data);
+
+
+/*
+ * osprd_lower_page(d, index)
+ *   Return page number 'index' from the disk's snapshot layers, or NULL
+ *   if no layer has it.  Called with 'd->page_lock' held.
+ */
+static struct page *osprd_lower_page(osprd_info_t *d, pgoff_t index)
+{
+	struct osprd_layer *l;
+	struct page *page = NULL;
+
+	for (l = d->base; l && !page; l = l->below)
+		page = radix_tree_lookup(&l->pages, index);
+	return page;
 }
 
-pid_node_t has_pid(struct pid_list *l, int pid) {
-	pid_node_t p = l->head;
-	while (p && p->pid != pid) {
-		p = p->next;
+
+/*
+ * osprd_get_page(d, index, gfp)
+ *   Return the sparse store's page number 'index', or NULL if it has
+ *   never been written.  If 'gfp' is nonzero, allocate a zeroed page
+ *   with those flags instead of returning NULL; NULL then means out of
+ *   memory.  Callers in atomic context must pass GFP_ATOMIC.
+ *   A page that is only in a snapshot layer is returned for reading;
+ *   with 'gfp', the disk gets its own copy instead.
+ *   The caller gets its own reference to the page and must put_page()
+ *   it when done, so a concurrent discard can't free it underneath us.
+ */
+static struct page *osprd_get_page(osprd_info_t *d, pgoff_t index, gfp_t gfp)
+{
+	struct page *page, *lower = NULL;
+	int preload = gfp & __GFP_WAIT;
+	uint8_t *data;
+
+	spin_lock(&d->page_lock);
+	if (!(page = radix_tree_lookup(&d->pages, index)))
+		page = lower = osprd_lower_page(d, index);
+	if (page)
+		get_page(page);
+	spin_unlock(&d->page_lock);
+	if (!gfp || (page && !lower))
+		return page;
+
+	// Copy on write.  The copy is a lowmem page so it can be filled
+	// without a second atomic kmap slot (some callers hold KM_USER0).
+	if (lower) {
+		if ((page = alloc_page(gfp))) {
+			data = kmap_atomic(lower, KM_USER1);
+			memcpy(page_address(page), data, PAGE_SIZE);
+			kunmap_atomic(data, KM_USER1);
+		}
+		put_page(lower);
+	} else
+		page = alloc_page(gfp | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!page)
+		return NULL;
+	if (preload && radix_tree_preload(gfp)) {
+		__free_page(page);
+		return NULL;
 	}
-	return p;
-}
 
-pid_node_t has_pid_r(struct pid_list *l, int pid) {
-	pid_node_t p = l->tail;
-	while (p && p->pid != pid) {
-		p = p->prev;
+	spin_lock(&d->page_lock);
+	page->index = index;
+	if (radix_tree_insert(&d->pages, index, page) != 0) {
+		// Another writer got there first (or the tree is out of
+		// memory, in which case the lookup fails too).
+		__free_page(page);
+		page = radix_tree_lookup(&d->pages, index);
 	}
-	return p;
+	if (page)
+		get_page(page);
+	spin_unlock(&d->page_lock);
+
+	if (preload)
+		radix_tree_preload_end();
+	return page;
 }
 
-pid_node_t has_pid_until(struct pid_list *l, int pid, pid_node_t end_node) {
-	pid_node_t p = l->head;
-	while (p && p != end_node && p->pid != pid) {
-		p = p->next;
+
+/*
+ * osprd_prepare_write(d, sector, len)
+ *   Make sure the sparse store has its own pages for the 'len' bytes
+ *   from 'sector', allocating and copying them up from snapshot layers
+ *   as needed, so a following osprd_transfer() under an atomic kmap
+ *   finds them and needn't allocate.  May sleep.  Returns 0 on
+ *   success, -ENOMEM on failure.
+ */
+static int osprd_prepare_write(osprd_info_t *d, sector_t sector,
+			       unsigned long len)
+{
+	pgoff_t index, last;
+	struct page *page;
+
+	if (d->data || d->zscratch || len == 0)
+		return 0;
+	last = (sector + len / SECTOR_SIZE - 1) >> PAGE_SECTORS_SHIFT;
+	for (index = sector >> PAGE_SECTORS_SHIFT; index <= last; index++) {
+		if (!(page = osprd_get_page(d, index, GFP_NOIO)))
+			return -ENOMEM;
+		put_page(page);
 	}
-	return p;
+	return 0;
 }
 
-pid_node_t has_pid_ticket(struct pid_list *l, int pid, unsigned ticket) {
-	pid_node_t p = l->head;
-	while (p && p->pid != pid && p->ticket != ticket) {
-		p = p->next;
-	}
-	return p;
+
+/*
+ * osprd_zaccount(d, z, sign)
+ *   Add (if 'sign' is 1) or subtract (if -1) compressed page 'z' to or
+ *   from the device's compression statistics.
+ */
+static void osprd_zaccount(osprd_info_t *d, struct osprd_zpage *z, int sign)
+{
+	d->zpages += sign;
+	if (z->len == 0)
+		d->zsame += sign;
+	d->zbytes += sign * (long) z->len;
 }
 
-void remove_pid(struct pid_list *l, int pid) {
-	pid_node_t p = has_pid(l, pid);
-	if (p == l->head) {
-		l->head = p->next;
-	}
-	if (p == l->tail) {
-		l->tail = p->prev;
+
+/*
+ * osprd_zload(d, zs, index)
+ *   Decompress page 'index' of the compressed store into 'zs->page'.
+ *   Only the lookup is done under 'd->page_lock'.  Returns the page's
+ *   generation, 0 if it isn't stored (reads as zeros).
+ */
+static unsigned long osprd_zload(osprd_info_t *d, struct osprd_zscratch *zs,
+				 pgoff_t index)
+{
+	struct osprd_zpage *z;
+	unsigned long *words = (unsigned long *) zs->page;
+	unsigned long fill = 0, gen = 0;
+	unsigned i, len = 0;
+
+	spin_lock(&d->page_lock);
+	if ((z = radix_tree_lookup(&d->pages, index))) {
+		len = z->len;
+		fill = z->fill;
+		gen = z->gen;
+		memcpy(zs->in, z->data, len + 1);
 	}
-	if (p) {
-		if (p->prev) {
-			p->prev->next = p->next;
+	spin_unlock(&d->page_lock);
+
+	if (len == 0) {
+		for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+			words[i] = fill;
+	} else if (len == PAGE_SIZE)
+		memcpy(zs->page, zs->in, PAGE_SIZE);
+	else {
+		// Raw inflate may read one byte past the end of the stream;
+		// osprd_zstore leaves a spare zero byte there.
+		zlib_inflateReset(&zs->inf);
+		zs->inf.next_in = zs->in;
+		zs->inf.avail_in = len + 1;
+		zs->inf.next_out = zs->page;
+		zs->inf.avail_out = PAGE_SIZE;
+		if (zlib_inflate(&zs->inf, Z_FINISH) != Z_STREAM_END
+		    || zs->inf.total_out != PAGE_SIZE) {
+			eprintk("osprd: can't decompress page %lu\n",
+				(unsigned long) index);
+			memset(zs->page, 0, PAGE_SIZE);
 		}
-		if (p->next) {
-			p->next->prev = p->prev;
-		}
-		kfree(p);
 	}
+	return gen;
 }
 
-void clean_pid_list(struct pid_list *l) {
-	pid_node_t p = l->head;
-	while (p) {
-		pid_node_t t = p;
-		p = p->next;
-		kfree(t);
+
+/*
+ * osprd_zstore(d, zs, index, gen)
+ *   Compress the page in 'zs->page' and store it as page 'index' of the
+ *   compressed store, replacing what was there.  Only the store itself
+ *   is done under 'd->page_lock'.  Unless 'gen' is OSPRD_ZGEN_ANY, the
+ *   page must still be the one osprd_zload() returned 'gen' for, or
+ *   nothing is stored and -EAGAIN is returned.  (A page that isn't
+ *   stored always reads as zeros, so generation 0 can't be stale.)
+ *   Returns 0 on success, -ENOMEM on failure.
+ */
+#define OSPRD_ZGEN_ANY	(~0UL)
+
+static int osprd_zstore(osprd_info_t *d, struct osprd_zscratch *zs,
+			pgoff_t index, unsigned long gen)
+{
+	unsigned long *words = (unsigned long *) zs->page;
+	unsigned nwords = PAGE_SIZE / sizeof(unsigned long);
+	struct osprd_zpage *z = NULL, *old = NULL;
+	uint8_t *src = zs->page;
+	unsigned i, len = PAGE_SIZE;
+	void **slot;
+
+	for (i = 1; i < nwords && words[i] == words[0]; i++)
+		/* nothing */;
+	if (i == nwords)
+		len = 0;
+	else {
+		zlib_deflateReset(&zs->def);
+		zs->def.next_in = zs->page;
+		zs->def.avail_in = PAGE_SIZE;
+		zs->def.next_out = zs->out;
+		zs->def.avail_out = PAGE_SIZE;
+		if (zlib_deflate(&zs->def, Z_FINISH) == Z_STREAM_END
+		    && zs->def.total_out < PAGE_SIZE) {
+			len = zs->def.total_out;
+			src = zs->out;
+		}
 	}
-	l->head = NULL;
-	l->tail = NULL;
-}
 
-void remove_pid_ticket(struct pid_list *l, int pid, unsigned ticket) {
-	pid_node_t p = has_pid_ticket(l, pid, ticket);
-	if (p == l->head) {
-		l->head = p->next;
+	// A zero page needs no entry at all.
+	if (len > 0 || words[0] != 0) {
+		if (!(z = kmalloc(sizeof(*z) + len + 1, GFP_ATOMIC)))
+			return -ENOMEM;
+		z->index = index;
+		z->len = len;
+		z->fill = words[0];
+		memcpy(z->data, src, len);
+		z->data[len] = 0;
 	}
-	if (p == l->tail) {
-		l->tail = p->prev;
+
+	// Replace the old entry in place, so there is nothing to allocate
+	// (and fail) after it's gone.
+	spin_lock(&d->page_lock);
+	if ((slot = radix_tree_lookup_slot(&d->pages, index)))
+		old = *slot;
+	if (gen != OSPRD_ZGEN_ANY && gen != (old ? old->gen : 0)) {
+		spin_unlock(&d->page_lock);
+		kfree(z);
+		return -EAGAIN;
 	}
-	if (p) {
-		if (p->prev) {
-			p->prev->next = p->next;
-		}
-		if (p->next) {
-			p->next->prev = p->prev;
+	if (z)
+		z->gen = ++d->zgen;
+	if (old) {
+		if (z)
+			*slot = z;
+		else
+			radix_tree_delete(&d->pages, index);
+		osprd_zaccount(d, old, -1);
+	} else if (z && radix_tree_insert(&d->pages, index, z) != 0) {
+		spin_unlock(&d->page_lock);
+		kfree(z);
+		return -ENOMEM;
+	}
+	if (z)
+		osprd_zaccount(d, z, 1);
+	spin_unlock(&d->page_lock);
+	kfree(old);
+	return 0;
+}
+
+
+/*
+ * osprd_ztransfer(d, sector, buffer, len, write)
+ *   osprd_transfer for the compressed store.  Each page is decompressed
+ *   into this CPU's scratch page (unless a write replaces all of it),
+ *   copied to or from, and compressed again if written.  A partial
+ *   write starts over if another write changed the page meanwhile.
+ *   Writing from a NULL 'buffer' writes zeros.
+ */
+static int osprd_ztransfer(osprd_info_t *d, sector_t sector, char *buffer,
+			   unsigned long len, int write)
+{
+	struct osprd_zscratch *zs;
+	unsigned long gen;
+	int r = 0;
+
+	while (len > 0 && r == 0) {
+		unsigned offset = (sector & (PAGE_SECTORS - 1)) * SECTOR_SIZE;
+		unsigned long chunk = min_t(unsigned long, len, PAGE_SIZE - offset);
+		pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+
+		zs = per_cpu_ptr(d->zscratch, get_cpu());
+		do {
+			gen = OSPRD_ZGEN_ANY;
+			if (!write || chunk < PAGE_SIZE)
+				gen = osprd_zload(d, zs, index);
+			if (!write)
+				memcpy(buffer, zs->page + offset, chunk);
+			else {
+				if (buffer)
+					memcpy(zs->page + offset, buffer, chunk);
+				else
+					memset(zs->page + offset, 0, chunk);
+				r = osprd_zstore(d, zs, index, gen);
+			}
+		} while (r == -EAGAIN);
+		put_cpu();
+
+		if (buffer)
+			buffer += chunk;
+		len -= chunk;
+		sector += chunk / SECTOR_SIZE;
+	}
+	return r;
+}
+
+
+/*
+ * osprd_free_pages(root, compressed)
+ *   Free every page of the sparse store tree 'root', or of the
+ *   compressed store tree if 'compressed' is set.
+ */
+static void osprd_free_pages(struct radix_tree_root *root, int compressed)
+{
+	void *pages[16];
+	pgoff_t index = 0;
+	unsigned i, n;
+
+	while ((n = radix_tree_gang_lookup(root, pages,
+					   index, ARRAY_SIZE(pages))) > 0) {
+		for (i = 0; i < n; i++) {
+			if (compressed)
+				index = ((struct osprd_zpage *) pages[i])->index;
+			else
+				index = ((struct page *) pages[i])->index;
+			radix_tree_delete(root, index++);
+			if (compressed)
+				kfree(pages[i]);
+			else
+				__free_page(pages[i]);
 		}
-		kfree(p);
 	}
 }
 
-void add_ticket(ticket_queue_t q, unsigned ticket) {
-	ticket_queue_node_t p1, p2;
-	if (!q->head) {
-		q->head = kmalloc(sizeof(struct ticket_queue_node), GFP_ATOMIC);
-		q->head->ticket = ticket;
-		q->head->next = NULL;
-		return;
-	} else if (q->head->ticket == ticket) {
-		return;
-	} else if (q->head->ticket > ticket) {
-		ticket_queue_node_t p = kmalloc(sizeof(struct ticket_queue_node), GFP_ATOMIC);
-		p->ticket = ticket;
-		p->next = q->head;		
-		q->head = p;	
-		return;
+
+/*
+ * osprd_put_layer(l)
+ *   Drop a reference to snapshot layer 'l', freeing it, and then maybe
+ *   the layers below it, once nothing is on top of it.
+ */
+static void osprd_put_layer(struct osprd_layer *l)
+{
+	struct osprd_layer *below;
+
+	while (l && atomic_dec_and_test(&l->refs)) {
+		below = l->below;
+		osprd_free_pages(&l->pages, 0);
+		kfree(l);
+		l = below;
 	}
+}
+
 
-	p1 = q->head;
-	p2 = p1->next;
-	while (p2 && p2->ticket < ticket) {
-		p1 = p2;
-		p2 = p2->next;	
+/*
+ * osprd_zero(d, sector, nsect)
+ *   Zero 'nsect' sectors starting at 'sector'.  The sparse store frees
+ *   every page the range covers completely, since a missing page
+ *   already reads as zeros, and clears the partial pages at the ends.
+ *   Returns 0 on success, -ENOMEM if a page can't be allocated.
+ */
+static int osprd_zero(osprd_info_t *d, sector_t sector, sector_t nsect)
+{
+	if (d->data) {
+		memset(d->data + sector * SECTOR_SIZE, 0, nsect * SECTOR_SIZE);
+		return 0;
+	} else if (d->zscratch)
+		return osprd_ztransfer(d, sector, NULL, nsect * SECTOR_SIZE, 1);
+
+	while (nsect > 0) {
+		pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+		unsigned first = sector & (PAGE_SECTORS - 1);
+		unsigned count = min_t(sector_t, nsect, PAGE_SECTORS - first);
+		struct page *page = NULL;
+		uint8_t *data;
+		int shared;
+
+		// A page in a snapshot layer would show through a hole, so
+		// such a page is overwritten with zeros instead.
+		spin_lock(&d->page_lock);
+		shared = osprd_lower_page(d, index) != NULL;
+		if (count == PAGE_SECTORS && !shared)
+			page = radix_tree_delete(&d->pages, index);
+		spin_unlock(&d->page_lock);
+
+		if (count == PAGE_SECTORS && !shared) {
+			// Drop the tree's reference; a transfer still using
+			// the page holds its own.
+			if (page)
+				put_page(page);
+		} else if ((page = osprd_get_page(d, index,
+						  shared ? GFP_NOIO : 0))) {
+			data = kmap_atomic(page, KM_USER1);
+			memset(data + first * SECTOR_SIZE, 0, count * SECTOR_SIZE);
+			kunmap_atomic(data, KM_USER1);
+			put_page(page);
+		} else if (shared)
+			return -ENOMEM;
+
+		sector += count;
+		nsect -= count;
 	}
-	if (p2 && p2->ticket == ticket) {
-		return;	
-	} else {
-		ticket_queue_node_t p = kmalloc(sizeof(struct ticket_queue_node), GFP_ATOMIC);
-		p->ticket = ticket;
-		p->next = p2;
-		p1->next = p;
+	return 0;
+}
+
+
+/*
+ * osprd_transfer(d, sector, buffer, len, write)
+ *   Copy 'len' bytes between 'buffer' and the ramdisk, starting at
+ *   'sector'.  Copies into the ramdisk if 'write' is set.
+ *   Returns 0 on success, -ENOMEM if a sparse page can't be allocated
+ *   or a compressed page can't be stored.  May be called in atomic
+ *   context, so a sparse page is allocated with GFP_ATOMIC; callers
+ *   that can sleep use osprd_prepare_write() first.
+ */
+static int osprd_transfer(osprd_info_t *d, sector_t sector, char *buffer,
+			  unsigned long len, int write)
+{
+	if (d->data) {
+		uint8_t *data = d->data + sector * SECTOR_SIZE;
+		if (write)
+			memcpy(data, buffer, len);
+		else
+			memcpy(buffer, data, len);
+		return 0;
+	} else if (d->zscratch)
+		return osprd_ztransfer(d, sector, buffer, len, write);
+
+	while (len > 0) {
+		unsigned offset = (sector & (PAGE_SECTORS - 1)) * SECTOR_SIZE;
+		unsigned long chunk = min_t(unsigned long, len, PAGE_SIZE - offset);
+		struct page *page = osprd_get_page(d, sector >> PAGE_SECTORS_SHIFT,
+						   write ? GFP_ATOMIC : 0);
+		uint8_t *data;
+
+		if (page) {
+			data = kmap_atomic(page, KM_USER1);
+			if (write)
+				memcpy(data + offset, buffer, chunk);
+			else
+				memcpy(buffer, data + offset, chunk);
+			kunmap_atomic(data, KM_USER1);
+			put_page(page);
+		} else if (write)
+			return -ENOMEM;
+		else
+			memset(buffer, 0, chunk);
+
+		buffer += chunk;
+		len -= chunk;
+		sector += chunk / SECTOR_SIZE;
 	}
+	return 0;
 }
 
-void find_next_valid_ticket(ticket_queue_t q, unsigned *ticket_tail, unsigned finished) {
-	unsigned ticket = *ticket_tail + finished;
-	while (1) {
-		if (!q->head || q->head->ticket > ticket) {
+
+/*
+ * osprd_transfer_bio(d, bio, sector)
+ *   Perform every segment of 'bio' against the ramdisk, starting at
+ *   '*sector', and advance '*sector' past the last sector transferred.
+ *   Returns 0 on success, a negative error code on failure.
+ */
+static int osprd_transfer_bio(osprd_info_t *d, struct bio *bio,
+			      sector_t *sector)
+{
+	struct bio_vec *bvec;
+	int i, r = 0;
+
+	bio_for_each_segment(bvec, bio, i) {
+		char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
+		r = osprd_transfer(d, *sector, buffer, bvec->bv_len,
+				   bio_data_dir(bio) == WRITE);
+		__bio_kunmap_atomic(buffer, KM_USER0);
+		if (r < 0)
 			break;
-		} else {
-			ticket_queue_node_t p = q->head;
-			if (q->head->ticket == ticket) {
-				ticket ++;
-			}
-			q->head = q->head->next;
-			kfree(p);
-			continue;		
-		}
+		*sector += bvec->bv_len / SECTOR_SIZE;
 	}
-	*ticket_tail = ticket;
+	return r;
+}
 
+
+/*
+ * osprd_load_page(d, index)
+ *   Read page 'index' of a backed disk in from its backing file.
+ *   Called with 'd->fault_lock' held.  Returns 0 or an error code.
+ */
+static int osprd_load_page(osprd_info_t *d, pgoff_t index)
+{
+	sector_t sector = (sector_t) index << PAGE_SECTORS_SHIFT;
+	unsigned long len = min_t(sector_t, PAGE_SECTORS,
+				  d->nsectors - sector) * SECTOR_SIZE;
+	loff_t pos = (loff_t) sector * SECTOR_SIZE;
+	mm_segment_t fs = get_fs();
+	ssize_t n;
+
+	set_fs(KERNEL_DS);
+	n = vfs_read(d->backing_file, (char __user *) d->fault_buf, len, &pos);
+	set_fs(fs);
+	if (n <= 0)
+		// Past the end of the file, the disk reads as zeros.
+		return n;
+	memset(d->fault_buf + n, 0, len - n);
+	if ((n = osprd_prepare_write(d, sector, len)) < 0)
+		return n;
+	return osprd_transfer(d, sector, (char *) d->fault_buf, len, 1);
 }
 
-// Declare useful helper functions
 
 /*
- * file2osprd(filp)
- *   Given an open file, check whether that file corresponds to an OSP ramdisk.
- *   If so, return a pointer to the ramdisk's osprd_info_t.
- *   If not, return NULL.
+ * osprd_fault_in(d, sector, nsect)
+ *   Make sure the pages holding 'nsect' sectors from 'sector' have been
+ *   read in from the backing file, if the disk has one, so they can be
+ *   read or written.  May sleep.  Returns 0 or an error code.
  */
-static osprd_info_t *file2osprd(struct file *filp);
+static int osprd_fault_in(osprd_info_t *d, sector_t sector, sector_t nsect)
+{
+	pgoff_t index, last;
+	int r = 0;
+
+	if (!d->backing_file || nsect == 0)
+		return 0;
+	last = (sector + nsect - 1) >> PAGE_SECTORS_SHIFT;
+	for (index = sector >> PAGE_SECTORS_SHIFT; index <= last && r == 0;
+	     index++) {
+		if (test_bit(index, d->loaded))
+			continue;
+		mutex_lock(&d->fault_lock);
+		if (!test_bit(index, d->loaded)
+		    && (r = osprd_load_page(d, index)) == 0)
+			set_bit(index, d->loaded);
+		mutex_unlock(&d->fault_lock);
+	}
+	return r;
+}
+
 
 /*
- * for_each_open_file(task, callback, user_data)
- *   Given a task, call the function 'callback' once for each of 'task's open
- *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
- *   the open file, and 'user_data' is copied from for_each_open_file's third
- *   argument.
+ * osprd_mark_dirty(d, sector, nsect)
+ *   Note that 'nsect' sectors from 'sector' were written, so the flusher
+ *   writes them back.  Call after writing the data.
  */
-static void for_each_open_file(struct task_struct *task,
-			       void (*callback)(struct file *filp,
-						osprd_info_t *user_data),
-			       osprd_info_t *user_data);
+static void osprd_mark_dirty(osprd_info_t *d, sector_t sector, sector_t nsect)
+{
+	pgoff_t index, last;
+
+	if (!d->backing_file || nsect == 0)
+		return;
+	last = (sector + nsect - 1) >> PAGE_SECTORS_SHIFT;
+	for (index = sector >> PAGE_SECTORS_SHIFT; index <= last; index++)
+		set_bit(index, d->dirty);
+}
+
+
+/*
+ * osprd_flush(d)
+ *   Write every dirty page of a backed disk back to its file, in runs
+ *   of up to OSPRD_FLUSH_BATCH consecutive pages.  A page's dirty bit
+ *   is cleared before the page is copied, so a write racing with the
+ *   copy dirties it again.  Only one flush may run at a time.
+ */
+static void osprd_flush(osprd_info_t *d)
+{
+	unsigned long npages = DIV_ROUND_UP(d->nsectors, PAGE_SECTORS);
+	unsigned long index = 0, n, i;
+	sector_t sector;
+	unsigned long len;
+	loff_t pos;
+	mm_segment_t fs;
+	ssize_t written;
+
+	while ((index = find_next_bit(d->dirty, npages, index)) < npages) {
+		for (n = 0; n < OSPRD_FLUSH_BATCH && index + n < npages
+			     && test_and_clear_bit(index + n, d->dirty); n++)
+			/* nothing */;
+
+		sector = (sector_t) index << PAGE_SECTORS_SHIFT;
+		len = min_t(sector_t, n * PAGE_SECTORS,
+			    d->nsectors - sector) * SECTOR_SIZE;
+		osprd_transfer(d, sector, (char *) d->flush_buf, len, 0);
+
+		pos = (loff_t) sector * SECTOR_SIZE;
+		fs = get_fs();
+		set_fs(KERNEL_DS);
+		written = vfs_write(d->backing_file,
+				    (const char __user *) d->flush_buf, len, &pos);
+		set_fs(fs);
+		// Name the file, not the disk: a disk that failed setup
+		// is flushed before it has a gendisk.
+		if (written != len) {
+			eprintk("osprd: can't write back %s: error %d\n",
+				d->backing_file->f_dentry->d_name.name,
+				written < 0 ? (int) written : -EIO);
+			for (i = 0; i < n; i++)
+				set_bit(index + i, d->dirty);
+			return;
+		}
+		index += n;
+	}
+}
+
+
+/*
+ * osprd_flusher(arg)
+ *   The write-back thread of a backed disk.
+ */
+static int osprd_flusher(void *arg)
+{
+	osprd_info_t *d = (osprd_info_t *) arg;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule_timeout(OSPRD_FLUSH_INTERVAL);
+		__set_current_state(TASK_RUNNING);
+		osprd_flush(d);
+	}
+	return 0;
+}
 
 
 /*
@@ -288,7 +889,10 @@ static void for_each_open_file(struct task_struct *task,
  */
 static void osprd_process_request(osprd_info_t *d, struct request *req)
 {
-	long offset, data_len;
+	struct bio *bio;
+	sector_t sector = req->sector;
+	int uptodate = 1;
+
 	if (!blk_fs_request(req)) {
 		end_request(req, 0);
 		return;
@@ -302,117 +906,1089 @@ static void osprd_process_request(osprd_info_t *d, struct request *req)
 	// Consider the 'req->sector', 'req->current_nr_sectors', and
 	// 'req->buffer' members, and the rq_data_dir() function.
 
-	// Your code here.
-	//eprintk("Should process request...\n");
-	if (req->current_nr_sectors > nsectors) {
-		// issue error	
+	// A merged request carries several bios, each with several
+	// segments; do all of them here rather than one segment per
+	// end_request() round trip.
+	if (req->sector + req->nr_sectors > d->nsectors) {
+		eprintk("osprd: request for sectors %lu-%lu is past the end\n",
+			(unsigned long) req->sector,
+			(unsigned long) (req->sector + req->nr_sectors - 1));
+		uptodate = 0;
+	} else {
+		rq_for_each_bio(bio, req) {
+			if (osprd_transfer_bio(d, bio, &sector) < 0) {
+				uptodate = 0;
+				break;
+			}
+		}
+	}
+
+	// Complete the whole request at once.
+	if (!end_that_request_first(req, uptodate, req->hard_nr_sectors)) {
+		blkdev_dequeue_request(req);
+		end_that_request_last(req, uptodate);
+	}
+}
+
+
+/*
+ * osprd_make_request(q, bio)
+ *   Called for every bio submitted to the ramdisk when use_bio is set,
+ *   or the disk is backed by a file.  Services each of the bio's
+ *   segments directly against the data array, without going through
+ *   the request queue.
+ */
+static int osprd_make_request(request_queue_t *q, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) q->queuedata;
+	sector_t sector = bio->bi_sector;
+	int r;
+
+	if (sector + bio_sectors(bio) > d->nsectors) {
+		bio_endio(bio, bio->bi_size, -EIO);
+		return 0;
+	}
+
+	r = osprd_fault_in(d, sector, bio_sectors(bio));
+	// Allocate sparse pages here, where we may sleep, rather than
+	// under the atomic kmaps in osprd_transfer_bio().
+	if (r == 0 && bio_data_dir(bio) == WRITE)
+		r = osprd_prepare_write(d, sector, bio->bi_size);
+	if (r == 0)
+		r = osprd_transfer_bio(d, bio, &sector);
+	if (r == 0 && bio_data_dir(bio) == WRITE)
+		osprd_mark_dirty(d, bio->bi_sector, bio_sectors(bio));
+	bio_endio(bio, bio->bi_size, r < 0 ? -EIO : 0);
+	return 0;
+}
+
+
+// This function is called when a /dev/osprdX file is opened.
+// You aren't likely to need to change this.
+static int osprd_open(struct inode *inode, struct file *filp)
+{
+	// Always set the O_SYNC flag. That way, we will get writes immediately
+	// instead of waiting for them to get through write-back caches.
+	filp->f_flags |= O_SYNC;
+	return 0;
+}
+
+int osprd_ioctl(struct inode *inode, struct file *filp,
+		unsigned int cmd, unsigned long arg);
+static void osprd_range_release_all(osprd_info_t *d, struct file *filp);
+static int osprd_create(sector_t nsect, struct osprd_layer *base);
+static int osprd_cancel_async(osprd_info_t *d, struct file *filp);
+static void osprd_restore_bias(osprd_info_t *d);
+
+// This function is called when a /dev/osprdX file is finally closed.
+// (If the file descriptor was dup2ed, this function is called only when the
+// last copy is closed.)
+static int osprd_close_last(struct inode *inode, struct file *filp)
+{
+	if (filp) {
+		osprd_info_t *d = file2osprd(filp);
+		int filp_writable = filp->f_mode & FMODE_WRITE;
+
+		// EXERCISE: If the user closes a ramdisk file that holds
+		// a lock, release the lock.  Also wake up blocked processes
+		// as appropriate.
+
+		// Your code here.
+		// Cancel a pending OSPRDIOCACQUIREASYNC first; if it was
+		// granted already, the lock is released below.
+		osp_spin_lock(&d->mutex);
+		osprd_cancel_async(d, filp);
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+		if (filp->f_flags & F_OSPRD_LOCKED) {
+			osprd_ioctl(inode, filp, OSPRDIOCRELEASE, 0);
+		}
+		osprd_range_release_all(d, filp);
+
+		// This line avoids compiler warnings; you may remove it.
+		(void) filp_writable, (void) d;
+
+	}
+
+	return 0;
+}
+
+
+// poll() and select() on a ramdisk file report it readable once it holds
+// the device lock, as when an OSPRDIOCACQUIREASYNC is granted.
+static unsigned int osprd_poll(struct file *filp, poll_table *wait)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	poll_wait(filp, &d->pollq, wait);
+	return (filp->f_flags & F_OSPRD_LOCKED) ? POLLIN | POLLRDNORM : 0;
+}
+
+
+/*
+ * Direct mappings.  mmap() on a ramdisk maps the disk's own memory
+ * rather than the page cache, so loads and stores reach the data with
+ * no copying.  The device lock governs them: mapping needs the lock,
+ * and a writable mapping needs the write lock.  Giving up the lock (or
+ * just the write lock) unmaps every mapping of the disk, and a fault
+ * without the lock gets SIGBUS.  Only shared mappings are allowed,
+ * since unmapping would lose a private mapping's copied pages.
+ * Stores through a mapping bypass the page cache, so read the disk
+ * with O_DIRECT while it is mapped.
+ */
+static struct page *osprd_nopage(struct vm_area_struct *vma,
+				 unsigned long address, int *type)
+{
+	struct file *filp = vma->vm_file;
+	osprd_info_t *d = file2osprd(filp);
+	pgoff_t index = vma->vm_pgoff
+		+ ((address - vma->vm_start) >> PAGE_SHIFT);
+	struct page *page;
+
+	// If the lock goes away after this check, osprd_unmap() bumps the
+	// mapping's truncate_count and the fault is retried.
+	if (!(filp->f_flags & F_OSPRD_LOCKED)
+	    || ((vma->vm_flags & VM_WRITE)
+		&& !(filp->f_flags & F_OSPRD_WRITE_LOCKED))
+	    || index >= osprd_npages(d))
+		return NOPAGE_SIGBUS;
+
+	if (d->data) {
+		page = vmalloc_to_page(d->data + ((size_t) index << PAGE_SHIFT));
+		get_page(page);
+	} else if (!(page = osprd_get_page(d, index, GFP_NOIO))) {
+		// A hole gets its own page, so later writes through the
+		// block device land in the mapped page
+		return NOPAGE_OOM;
+	}
+	if (type)
+		*type = VM_FAULT_MINOR;
+	return page;
+}
+
+static void osprd_vma_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&file2osprd(vma->vm_file)->mapped);
+}
+
+static void osprd_vma_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&file2osprd(vma->vm_file)->mapped);
+}
+
+static struct vm_operations_struct osprd_vm_ops = {
+	.open = osprd_vma_open,
+	.close = osprd_vma_close,
+	.nopage = osprd_nopage
+};
+
+static int osprd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	// Compressed pages have no memory to map, and a backing file
+	// would never hear of stores through a mapping.
+	if (d->zscratch || d->backing_file)
+		return -ENODEV;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (vma->vm_pgoff + ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT)
+	    > osprd_npages(d))
+		return -ENXIO;
+	if (!(filp->f_flags & F_OSPRD_LOCKED))
+		return -EACCES;
+	if (!(filp->f_flags & F_OSPRD_WRITE_LOCKED)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		// and no mprotect() to writable later
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_flags |= VM_RESERVED;
+	vma->vm_ops = &osprd_vm_ops;
+	osprd_vma_open(vma);
+	return 0;
+}
+
+/* Unmap the part of every mapping of 'd' that shows bytes [start,
+ * start + len) (through the end if 'len' is 0), so the next access
+ * faults and osprd_nopage() looks again.  Called after a lock is given
+ * up and after the pages under a mapping change. */
+static void osprd_unmap(osprd_info_t *d, struct address_space *mapping,
+			loff_t start, loff_t len)
+{
+	if (atomic_read(&d->mapped))
+		unmap_mapping_range(mapping, start, len, 1);
+}
+
+
+/*
+ * osprd_zero_range(d, bdev, arg)
+ *   Handle BLKDISCARD and BLKZEROOUT: zero the byte range that 'arg'
+ *   points to, freeing its pages if the store is sparse.
+ */
+static int osprd_zero_range(osprd_info_t *d, struct block_device *bdev,
+			    unsigned long arg)
+{
+	uint64_t range[2];
+	uint64_t size = (uint64_t) d->nsectors * SECTOR_SIZE;
+	struct address_space *mapping = bdev->bd_inode->i_mapping;
+	loff_t start, end;
+	int r;
+
+	if (copy_from_user(range, (void __user *) arg, sizeof(range)))
+		return -EFAULT;
+	if (((range[0] | range[1]) & (SECTOR_SIZE - 1))
+	    || range[0] > size || range[1] > size - range[0])
+		return -EINVAL;
+	if (range[1] == 0)
+		return 0;
+
+	// Push out dirty cached data first so it can't land on top of
+	// the zeros later, then drop the cached pages of the range so
+	// reads go to the device.
+	fsync_bdev(bdev);
+	if ((r = osprd_fault_in(d, range[0] / SECTOR_SIZE,
+				range[1] / SECTOR_SIZE)) == 0
+	    && (r = osprd_zero(d, range[0] / SECTOR_SIZE,
+			       range[1] / SECTOR_SIZE)) == 0)
+		osprd_mark_dirty(d, range[0] / SECTOR_SIZE,
+				 range[1] / SECTOR_SIZE);
+
+	// Pages wholly inside the range can simply be thrown away.  A
+	// partial page at either end also caches sectors outside the
+	// range, which may have been dirtied since fsync_bdev(); unlike
+	// truncation, invalidate_inode_pages2_range() keeps a dirty page
+	// rather than dropping its data.
+	start = PAGE_CACHE_ALIGN(range[0]);
+	end = (range[0] + range[1]) & PAGE_CACHE_MASK;
+	if (start < end)
+		truncate_inode_pages_range(mapping, start, end - 1);
+	if (range[0] & ~PAGE_CACHE_MASK)
+		invalidate_inode_pages2_range(mapping,
+					      range[0] >> PAGE_CACHE_SHIFT,
+					      range[0] >> PAGE_CACHE_SHIFT);
+	if ((range[0] + range[1]) & ~PAGE_CACHE_MASK)
+		invalidate_inode_pages2_range(mapping,
+					      end >> PAGE_CACHE_SHIFT,
+					      end >> PAGE_CACHE_SHIFT);
+	// Freed pages may still be mapped
+	osprd_unmap(d, mapping, range[0], range[1]);
+	return r;
+}
+
+
+/*
+ * osprd_snapshot(d, bdev)
+ *   Handle OSPRDIOCSNAPSHOT: create a new disk holding a copy of 'd' as
+ *   it is now, and return its minor number.  Nothing is copied: 'd's
+ *   pages become a frozen layer that both disks read through, and each
+ *   disk copies a page into its own tree the first time it writes it.
+ *   Writes in flight meanwhile may or may not make it into the copy;
+ *   hold the device lock for an exact one.
+ *   A disk with a backing file can't be snapshotted: pages it hasn't
+ *   read in yet are only in the file, and the layers don't reach it.
+ */
+static int osprd_snapshot(osprd_info_t *d, struct block_device *bdev)
+{
+	struct osprd_layer *l;
+
+	// A flat store can't share pages, and compressed pages aren't
+	// layered.
+	if (d->data || d->zscratch)
+		return -EINVAL;
+	if (d->backing_file)
+		return -EOPNOTSUPP;
+	if (!(l = kmalloc(sizeof(*l), GFP_KERNEL)))
+		return -ENOMEM;
+
+	// Cached writes belong in the snapshot.
+	fsync_bdev(bdev);
+
+	spin_lock(&d->page_lock);
+	l->pages = d->pages;
+	INIT_RADIX_TREE(&d->pages, GFP_ATOMIC);
+	l->below = d->base;		// 'd's reference moves up here
+	atomic_set(&l->refs, 2);	// 'd' and the snapshot
+	d->base = l;
+	spin_unlock(&d->page_lock);
+	// Mapped pages are in the frozen layer now; a store through a
+	// mapping must fault and copy first.
+	osprd_unmap(d, bdev->bd_inode->i_mapping, 0, 0);
+
+	return osprd_create(d->nsectors, l);
+}
+
+
+static void osprd_drain_readers(osprd_info_t *d);
+static void osprd_restore_bias(osprd_info_t *d);
+
+/*
+ * osprd_lock_vector_wait(files, n)
+ *   Lock the 'n' files, sorted by minor number, blocking until every one
+ *   is ours.  The devices' mutexes are all taken, in that order, while
+ *   one deadlock search covers the whole vector and a waiter is queued
+ *   on each device; so the process is in the wait-for graph for all of
+ *   them before anybody can start waiting on one it is granted.
+ *   Returns 0, or -EDEADLK, -ENOMEM or -ERESTARTSYS with nothing held.
+ */
+static int osprd_lock_vector_wait(struct file **files, unsigned n)
+{
+	struct osprd_lock *locks[OSPRD_LOCKVEC_MAX];
+	pid_node_t holders[OSPRD_LOCKVEC_MAX];
+	struct osprd_waiter *w;
+	osprd_info_t *d;
+	unsigned i, granted;
+	int r = 0;
+
+	if (n == 0)
+		return 0;
+	w = kmalloc(n * sizeof(*w), GFP_KERNEL);
+	for (i = 0; i < n; i++)
+		if (!(holders[i] = kmalloc(sizeof(*holders[i]), GFP_KERNEL)))
+			r = -ENOMEM;
+	if (!w || r < 0) {
+		for (i = 0; i < n; i++)
+			kfree(holders[i]);
+		kfree(w);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		d = file2osprd(files[i]);
+		osp_spin_lock(&d->mutex);
+		osprd_drain_readers(d);
+		locks[i] = &d->lock;
+	}
+	if (check_deadlock_vector(locks, n, current->pid)) {
+		for (i = 0; i < n; i++)
+			osprd_stat_inc(locks[i], deadlocks);
+		r = -EDEADLK;
+	} else
+		for (i = 0; i < n; i++) {
+			w[i].task = current;
+			w[i].filp = NULL;
+			osprd_lock_queue(locks[i], &w[i], holders[i],
+					 current->pid,
+					 (files[i]->f_mode & FMODE_WRITE) != 0);
+		}
+	for (i = n; i-- > 0; ) {
+		d = file2osprd(files[i]);
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+	}
+	if (r < 0) {
+		for (i = 0; i < n; i++)
+			kfree(holders[i]);
+		kfree(w);
+		return r;
+	}
+
+	// Sleep until every waiter is granted, as OSPRDIOCACQUIRE does.
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		for (granted = 0; granted < n && w[granted].granted; granted++)
+			/* nothing */;
+		if (granted == n || signal_pending(current))
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	for (i = 0; i < n; i++) {
+		d = file2osprd(files[i]);
+		osp_spin_lock(&d->mutex);
+		d->lock.nwaiters --;
+		if (w[i].granted)
+			files[i]->f_flags |= osprd_lock_flags(w[i].writable);
+		else {
+			osprd_lock_abandon(&d->lock, &w[i]);
+			kfree(holders[i]);
+			osprd_stat_inc(&d->lock, interrupted);
+			r = -ERESTARTSYS;
+		}
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+	}
+	// Interrupted: give back the locks we did get
+	if (r < 0)
+		for (i = 0; i < n; i++)
+			if (w[i].granted)
+				osprd_ioctl(files[i]->f_dentry->d_inode,
+					    files[i], OSPRDIOCRELEASE, 0);
+	kfree(w);
+	return r;
+}
+
+/*
+ * osprd_lock_vector(arg, try)
+ *   Handle OSPRDIOCACQUIREVEC and OSPRDIOCTRYACQUIREVEC: lock every file
+ *   in the struct osprd_lockvec at 'arg', blocking or not as 'try' says.
+ *   The files are locked in minor-number order, so processes doing this
+ *   can't wait on each other in a cycle; a blocking call waits for all
+ *   of them at once (see osprd_lock_vector_wait).  On failure the locks
+ *   already taken are released, so the caller holds all of them or none.
+ */
+static int osprd_lock_vector(unsigned long arg, int try)
+{
+	struct osprd_lockvec v;
+	struct file *files[OSPRD_LOCKVEC_MAX], *f;
+	unsigned i, n, locked;
+	int r = 0;
+
+	if (copy_from_user(&v, (void __user *) arg, sizeof(v)))
+		return -EFAULT;
+	if (v.count > OSPRD_LOCKVEC_MAX)
+		return -EINVAL;
+
+	// Collect the files, insertion-sorted by minor number.
+	for (n = 0; n < v.count; n++) {
+		if (!(f = fget(v.fds[n]))) {
+			r = -EBADF;
+			goto out;
+		} else if (!file2osprd(f)) {
+			fput(f);
+			r = -EINVAL;
+			goto out;
+		}
+		for (i = n; i > 0 && file2osprd(files[i - 1])->gd->first_minor
+			     > file2osprd(f)->gd->first_minor; i--)
+			files[i] = files[i - 1];
+		files[i] = f;
+	}
+	// One lock per device per process
+	for (i = 1; i < n; i++)
+		if (file2osprd(files[i]) == file2osprd(files[i - 1])) {
+			r = -EINVAL;
+			goto out;
+		}
+
+	if (!try) {
+		r = osprd_lock_vector_wait(files, n);
+		goto out;
+	}
+	for (locked = 0; locked < n; locked++)
+		if ((r = osprd_ioctl(files[locked]->f_dentry->d_inode,
+				     files[locked], OSPRDIOCTRYACQUIRE, 0)) < 0)
+			break;
+	if (r < 0)
+		while (locked-- > 0)
+			osprd_ioctl(files[locked]->f_dentry->d_inode,
+				    files[locked], OSPRDIOCRELEASE, 0);
+
+ out:
+	for (i = 0; i < n; i++)
+		fput(files[i]);
+	return r;
+}
+
+
+/*
+ * Reader fast path.
+ *
+ * While 'd->reader_bias' is set, no writer holds or waits for the device
+ * lock, so a reader can take it just by counting itself on its own CPU;
+ * it never touches 'd->mutex' or the wait queue.  Anything that needs
+ * the ticket lock first calls osprd_drain_readers(), which clears the
+ * bias and folds the fast readers into 'read_lock_cnt' and
+ * 'locking_procs'.  From then on they are ordinary readers to the slow
+ * path and to check_deadlock(), which therefore never needs to look at
+ * the per-CPU lists: nobody waits on a device whose bias is set.  The
+ * bias returns when no writer holds the lock and nobody waits.
+ */
+
+/* Whether the current process holds a lock on 'd'.  Every lock, fast or
+ * slow, marks the file it was taken on with F_OSPRD_LOCKED, so looking
+ * through the process's own open files is enough: no other process's
+ * state, and no other CPU's readers, need be locked. */
+static int osprd_holds_lock(osprd_info_t *d)
+{
+	struct file *f;
+	int fd, held = 0;
+
+	spin_lock(&current->files->file_lock);
+	{
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 13)
+		struct files_struct *fdt = current->files;
+#else
+		struct fdtable *fdt = current->files->fdt;
+#endif
+		for (fd = 0; fd < fdt->max_fds && !held; fd++)
+			held = (f = fdt->fd[fd])
+				&& (f->f_flags & F_OSPRD_LOCKED)
+				&& file2osprd(f) == d;
+	}
+	spin_unlock(&current->files->file_lock);
+	return held;
+}
+
+/* Give back a holder node to 'rc's spares.  Called with 'rc->lock' held. */
+static void osprd_readers_put(struct osprd_readers *rc, pid_node_t node)
+{
+	if (rc->nspare < OSPRD_SPARE_READERS) {
+		node->next = rc->spare;
+		rc->spare = node;
+		rc->nspare++;
+	} else
+		kfree(node);
+}
+
+/* Take a read lock on the fast path.  Returns 1 if we got it, 0 if the
+ * slow path must be used, or -EDEADLK if the process holds a lock
+ * already, as the slow path would. */
+static int osprd_read_lock_fast(osprd_info_t *d)
+{
+	struct osprd_readers *rc;
+	pid_node_t node;
+	int locked = 0;
+
+	if (!d->reader_bias)
+		return 0;
+	if (osprd_holds_lock(d))
+		return -EDEADLK;
+
+	rc = per_cpu_ptr(d->readers, get_cpu());
+	spin_lock(&rc->lock);
+	put_cpu();
+	if ((node = rc->spare)) {
+		rc->spare = node->next;
+		rc->nspare--;
+	} else
+		node = kmalloc(sizeof(*node), GFP_ATOMIC);
+	if (node && d->reader_bias) {
+		node->pid = current->pid;
+		node->ticket = 0;
+		node->since = osprd_usecs();
+		rc->count++;
+		link_pid(&rc->pids, node);
+		locked = 1;
+	} else if (node)
+		osprd_readers_put(rc, node);
+	spin_unlock(&rc->lock);
+
+	if (locked) {
+		osprd_stat_inc(&d->lock, acquires);
+		osprd_stat_hist(&d->lock, wait_us, 0);
+	}
+	return locked;
+}
+
+static int osprd_readers_remove(osprd_info_t *d, struct osprd_readers *rc)
+{
+	pid_node_t p;
+
+	spin_lock(&rc->lock);
+	if ((p = has_pid(&rc->pids, current->pid))) {
+		osprd_stat_hist(&d->lock, hold_us, osprd_usecs() - p->since);
+		unlink_pid(&rc->pids, p);
+		osprd_readers_put(rc, p);
+		rc->count--;
+	}
+	spin_unlock(&rc->lock);
+	return p != NULL;
+}
+
+/* Release a fast-path read lock.  Returns 0 if the caller's read lock
+ * isn't on the fast path (any more), so the slow path must release it. */
+static int osprd_read_unlock_fast(osprd_info_t *d)
+{
+	int cpu, this;
+
+	// A cleared bias means our lock, if it was fast, has been (or is
+	// being, under 'd->mutex') moved to the slow path.
+	if (!d->reader_bias)
+		return 0;
+
+	// Look on this CPU first; the process may have migrated since it
+	// took the lock.
+	this = get_cpu();
+	put_cpu();
+	if (osprd_readers_remove(d, per_cpu_ptr(d->readers, this)))
+		return 1;
+	for_each_possible_cpu(cpu)
+		if (cpu != this
+		    && osprd_readers_remove(d, per_cpu_ptr(d->readers, cpu)))
+			return 1;
+	return 0;
+}
+
+/* Called with 'd->mutex' held. */
+static void osprd_drain_readers(osprd_info_t *d)
+{
+	int cpu;
+
+	if (!d->reader_bias)
+		return;
+	d->reader_bias = 0;
+	spin_lock(&osprd_wfg_lock);
+	for_each_possible_cpu(cpu) {
+		struct osprd_readers *rc = per_cpu_ptr(d->readers, cpu);
+		spin_lock(&rc->lock);
+		d->lock.read_lock_cnt += rc->count;
+		rc->count = 0;
+		splice_pid_list(&d->lock.locking_procs, &rc->pids);
+		spin_unlock(&rc->lock);
+	}
+	spin_unlock(&osprd_wfg_lock);
+}
+
+/* Wake 'w', which osprd_grant_waiters() just handed the lock to.  An
+ * asynchronous waiter's file is marked locked instead, and its poll()ers
+ * woken. */
+static void osprd_lock_wake(struct osprd_lock *l, struct osprd_waiter *w)
+{
+	osprd_info_t *d = container_of(l, osprd_info_t, lock);
+
+	if (w->filp) {
+		w->filp->f_flags |= osprd_lock_flags(w->writable);
+		l->nwaiters --;
+		kfree(w);
+		wake_up_interruptible(&d->pollq);
+	} else
+		wake_up_process(w->task);
+}
+
+/* Called with 'd->mutex' held.  A range writer must see every reader,
+ * so the bias stays off while one holds or waits. */
+static void osprd_restore_bias(osprd_info_t *d)
+{
+	if (d->lock.write_lock_cnt == 0 && d->lock.nwaiters == 0
+	    && d->range_writers == 0)
+		d->reader_bias = 1;
+}
+
+/* Return 'filp's pending OSPRDIOCACQUIREASYNC waiter, or NULL.
+ * Called with 'd->mutex' held. */
+static struct osprd_waiter *osprd_async_waiter(osprd_info_t *d,
+					       struct file *filp)
+{
+	struct osprd_waiter *w;
+
+	list_for_each_entry(w, &d->lock.waiters, list)
+		if (w->filp == filp)
+			return w;
+	return NULL;
+}
+
+/* Cancel 'filp's pending OSPRDIOCACQUIREASYNC, if any, the same way a
+ * signal cancels a blocked OSPRDIOCACQUIRE.  Returns 1 if there was one.
+ * Called with 'd->mutex' held. */
+static int osprd_cancel_async(osprd_info_t *d, struct file *filp)
+{
+	struct osprd_waiter *w = osprd_async_waiter(d, filp);
+
+	if (!w)
+		return 0;
+	d->lock.nwaiters --;
+	osprd_lock_abandon(&d->lock, w);
+	kfree(w->holder);
+	kfree(w);
+	return 1;
+}
+
+/*
+ * Range locks.  All of this runs with 'd->mutex' held.
+ *
+ * The tree is an interval tree: sorted by start sector, with each node
+ * also keeping the largest end sector in its subtree ('max_end').  So
+ * for_each_range_lock() visits just the locks overlapping [lo, hi), in
+ * start order, skipping any subtree that ends at or before 'lo'.
+ * 2.6.18's rbtree has no augmentation hooks, so range_insert() and
+ * range_remove() fix 'max_end' up along the paths that rebalancing can
+ * have rotated, as later kernels' rb_augment_insert() and
+ * rb_augment_erase_end() do.
+ *
+ * Range locks and the whole-device lock exclude each other: the device
+ * lock counts the granted ranges in 'range_read_cnt' and
+ * 'range_write_cnt' and won't be granted over a conflicting one, and a
+ * range waits while the device lock is held, or being upgraded, in a
+ * conflicting mode.  A range that waits is entered in the wait-for graph,
+ * so deadlocks through any mix of range and device locks are found.
+ */
+#define range_entry(n)	rb_entry((n), osprd_range_lock_t, node)
+
+static void range_update_max(struct rb_node *n)
+{
+	osprd_range_lock_t *lk = range_entry(n);
+
+	lk->max_end = lk->end;
+	if (n->rb_left && range_entry(n->rb_left)->max_end > lk->max_end)
+		lk->max_end = range_entry(n->rb_left)->max_end;
+	if (n->rb_right && range_entry(n->rb_right)->max_end > lk->max_end)
+		lk->max_end = range_entry(n->rb_right)->max_end;
+}
+
+/* Recompute 'max_end' from 'n' up to the root, and for the sibling of
+ * each node on the way, which a rotation may have moved there. */
+static void range_update_path(struct rb_node *n)
+{
+	struct rb_node *parent;
+
+	for (; n; n = parent) {
+		range_update_max(n);
+		if (!(parent = rb_parent(n)))
+			break;
+		if (n == parent->rb_left && parent->rb_right)
+			range_update_max(parent->rb_right);
+		else if (n == parent->rb_right && parent->rb_left)
+			range_update_max(parent->rb_left);
+	}
+}
+
+/* The leftmost lock under 'n' that overlaps [lo, hi), or NULL. */
+static struct rb_node *range_search(struct rb_node *n, sector_t lo,
+				    sector_t hi)
+{
+	while (n) {
+		if (n->rb_left && range_entry(n->rb_left)->max_end > lo) {
+			n = n->rb_left;
+			continue;
+		}
+		if (range_entry(n)->start >= hi)
+			return NULL;
+		if (range_entry(n)->end > lo)
+			return n;
+		n = n->rb_right;
+		if (n && range_entry(n)->max_end <= lo)
+			return NULL;
+	}
+	return NULL;
+}
+
+/* The next lock after 'n', in start order, that overlaps [lo, hi). */
+static struct rb_node *range_next(struct rb_node *n, sector_t lo,
+				  sector_t hi)
+{
+	struct rb_node *next = n->rb_right, *prev;
+
+	for (;;) {
+		if (next && range_entry(next)->max_end > lo)
+			return range_search(next, lo, hi);
+		// Up until we come from a left child
+		do {
+			if (!(next = rb_parent(n)))
+				return NULL;
+			prev = n;
+			n = next;
+			next = n->rb_right;
+		} while (prev == next);
+		if (range_entry(n)->start >= hi)
+			return NULL;
+		if (range_entry(n)->end > lo)
+			return n;
+	}
+}
+
+#define for_each_range_lock(l, n, d, lo, hi)				\
+	for (n = range_search((d)->range_locks.rb_node, (lo), (hi));	\
+	     n && ((l) = range_entry(n), 1);				\
+	     n = range_next(n, (lo), (hi)))
+
+static int range_conflicts(osprd_range_lock_t *a, osprd_range_lock_t *b)
+{
+	return a->start < b->end && b->start < a->end
+		&& (a->writable || b->writable);
+}
+
+/* Whether 'lk' can be held alongside the device lock as it is now.  An
+ * upgrade to the write lock goes ahead of new ranges. */
+static int range_device_ok(osprd_info_t *d, osprd_range_lock_t *lk)
+{
+	return d->lock.write_lock_cnt == 0 && !d->lock.upgrader
+		&& (!lk->writable || d->lock.read_lock_cnt == 0);
+}
+
+/* Grant 'lk' if it is waiting and can be held now.  Returns 1 if so. */
+static int range_grant(osprd_info_t *d, osprd_range_lock_t *lk)
+{
+	if (lk->granted || lk->blockers || !range_device_ok(d, lk))
+		return 0;
+	spin_lock(&osprd_wfg_lock);
+	hlist_del(&lk->wait.hash);
+	lk->granted = 1;
+	spin_unlock(&osprd_wfg_lock);
+	if (lk->writable)
+		d->lock.range_write_cnt++;
+	else
+		d->lock.range_read_cnt++;
+	return 1;
+}
+
+/* Grant every waiting range that the device lock no longer keeps out,
+ * after it is released or downgraded, and wake their tasks. */
+static void range_grant_all(osprd_info_t *d)
+{
+	struct rb_node *n;
+	int wake = 0;
+
+	for (n = rb_first(&d->range_locks); n; n = rb_next(n))
+		wake |= range_grant(d, rb_entry(n, osprd_range_lock_t, node));
+	if (wake)
+		wake_up_all(&d->range_blockq);
+}
+
+/* Add 'lk' to the tree, granted or, if 'wait', waiting. */
+static void range_insert(osprd_info_t *d, osprd_range_lock_t *lk, int wait)
+{
+	struct rb_node **p = &d->range_locks.rb_node, *parent = NULL;
+
+	spin_lock(&osprd_wfg_lock);
+	while (*p) {
+		parent = *p;
+		if (lk->start < rb_entry(parent, osprd_range_lock_t, node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	lk->max_end = lk->end;
+	rb_link_node(&lk->node, parent, p);
+	rb_insert_color(&lk->node, &d->range_locks);
+	// Rebalancing rotates around the new node's parent and grandparent
+	range_update_path(lk->node.rb_left ? lk->node.rb_left
+			  : lk->node.rb_right ? lk->node.rb_right
+			  : &lk->node);
+	if (wait)
+		hlist_add_head(&lk->wait.hash, osprd_waiting_head(lk->pid));
+	else
+		lk->granted = 1;
+	spin_unlock(&osprd_wfg_lock);
+
+	if (lk->writable)
+		d->range_writers++;
+	if (lk->granted && lk->writable)
+		d->lock.range_write_cnt++;
+	else if (lk->granted)
+		d->lock.range_read_cnt++;
+}
+
+/* Remove and free 'lk', and grant whatever that lets in.  Returns 1 if
+ * another range lock was granted. */
+static int range_remove(osprd_info_t *d, osprd_range_lock_t *lk)
+{
+	osprd_range_lock_t *l;
+	struct rb_node *n, *deepest;
+	int wake = 0;
+
+	for_each_range_lock(l, n, d, lk->start, lk->end)
+		if ((int) (l->ticket - lk->ticket) > 0 && range_conflicts(l, lk)
+		    && --l->blockers == 0)
+			wake |= range_grant(d, l);
+
+	// The deepest node whose subtree erasing changes: where the
+	// successor that replaces 'lk' came from, or 'lk's parent.
+	n = &lk->node;
+	if (!n->rb_left && !n->rb_right)
+		deepest = rb_parent(n);
+	else if (!n->rb_right)
+		deepest = n->rb_left;
+	else if (!n->rb_left)
+		deepest = n->rb_right;
+	else {
+		deepest = rb_next(n);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != n)
+			deepest = rb_parent(deepest);
 	}
 
-	offset = req->sector * SECTOR_SIZE;
-	data_len = req->current_nr_sectors * SECTOR_SIZE;
-	if (rq_data_dir(req) == WRITE) {
-		memcpy(d->data + offset, req->buffer, data_len);	
-		//copy_from_user(d->data + offset, req->buffer, data_len);	
-	} else if (rq_data_dir(req) == READ) {
-		memcpy(req->buffer, d->data + offset, data_len);
-		//copy_to_user(req->buffer, d->data + offset, data_len);
-	} else {
-		// issue error
+	spin_lock(&osprd_wfg_lock);
+	rb_erase(&lk->node, &d->range_locks);
+	range_update_path(deepest);
+	if (!lk->granted)
+		hlist_del(&lk->wait.hash);
+	spin_unlock(&osprd_wfg_lock);
+
+	if (lk->writable)
+		d->range_writers--;
+	if (lk->granted) {
+		if (lk->writable)
+			d->lock.range_write_cnt--;
+		else
+			d->lock.range_read_cnt--;
+		// The device lock may be free for its waiters now
+		osprd_grant_waiters(&d->lock);
 	}
+	osprd_restore_bias(d);
+	kfree(lk);
+	return wake;
+}
 
-	end_request(req, 1);
+/* Deadlock search hooks (see osprdlock.h).  A task waiting for the device
+ * lock waits for the granted ranges too; unless it is the one the search
+ * started from, whose mode is known, all of them are counted. */
+static void osprd_wfg_holders(struct osprd_wfg_search *s,
+			      struct osprd_lock *l)
+{
+	osprd_info_t *d = container_of(l, osprd_info_t, lock);
+	struct rb_node *n;
+
+	for (n = rb_first(&d->range_locks); n && !s->found; n = rb_next(n)) {
+		osprd_range_lock_t *lk = rb_entry(n, osprd_range_lock_t, node);
+		if (lk->granted
+		    && (l != s->start || s->writable || lk->writable))
+			osprd_wfg_follow(s, lk->pid);
+	}
 }
 
+/* A waiting range waits for the conflicting ranges that arrived before
+ * it, and for the holders of the device lock.  A reader held up only by
+ * other readers there is behind a range writer that waits for them. */
+static void osprd_wfg_blockers(struct osprd_wfg_search *s,
+			       struct osprd_waiter *w)
+{
+	osprd_range_lock_t *lk = container_of(w, osprd_range_lock_t, wait);
+	osprd_info_t *d = file2osprd(lk->filp);
+	osprd_range_lock_t *l;
+	struct rb_node *n;
+	pid_node_t p;
+
+	for_each_range_lock(l, n, d, lk->start, lk->end) {
+		if (s->found)
+			return;
+		if (l != lk && (int) (lk->ticket - l->ticket) > 0
+		    && range_conflicts(l, lk))
+			osprd_wfg_follow(s, l->pid);
+	}
+	for (p = d->lock.locking_procs.head; p && !s->found; p = p->next)
+		osprd_wfg_follow(s, p->pid);
+}
 
-// This function is called when a /dev/osprdX file is opened.
-// You aren't likely to need to change this.
-static int osprd_open(struct inode *inode, struct file *filp)
+static int copy_range(osprd_info_t *d, struct osprd_range *range,
+		      unsigned long arg)
 {
-	// Always set the O_SYNC flag. That way, we will get writes immediately
-	// instead of waiting for them to get through write-back caches.
-	filp->f_flags |= O_SYNC;
+	if (copy_from_user(range, (void __user *) arg, sizeof(*range)))
+		return -EFAULT;
+	if (range->start >= d->nsectors
+	    || range->count > d->nsectors - range->start)
+		return -EINVAL;
+	if (range->count == 0)
+		range->count = d->nsectors - range->start;
 	return 0;
 }
 
-int osprd_ioctl(struct inode *inode, struct file *filp,
-		unsigned int cmd, unsigned long arg);
-
-// This function is called when a /dev/osprdX file is finally closed.
-// (If the file descriptor was dup2ed, this function is called only when the
-// last copy is closed.)
-static int osprd_close_last(struct inode *inode, struct file *filp)
+/*
+ * osprd_range_acquire(d, filp, arg, try)
+ *   Lock the sectors in the struct osprd_range at 'arg', for writing if
+ *   'filp' is writable.  Like OSPRDIOCACQUIRE, a process may not wait on
+ *   a range that overlaps one it already holds, or wait in a cycle of
+ *   range and device locks (-EDEADLK), and if 'try' is set any wait at
+ *   all returns -EBUSY instead.
+ */
+static int osprd_range_acquire(osprd_info_t *d, struct file *filp,
+			       unsigned long arg, int try)
 {
-	if (filp) {
-		osprd_info_t *d = file2osprd(filp);
-		int filp_writable = filp->f_mode & FMODE_WRITE;
-
-		// EXERCISE: If the user closes a ramdisk file that holds
-		// a lock, release the lock.  Also wake up blocked processes
-		// as appropriate.
-
-		// Your code here.
-		if (filp->f_flags & F_OSPRD_LOCKED) {
-			osprd_ioctl(inode, filp, OSPRDIOCRELEASE, 0);
+	struct osprd_range range;
+	osprd_range_lock_t *lk, *l;
+	struct rb_node *n;
+	int r, wait;
+
+	if ((r = copy_range(d, &range, arg)) < 0)
+		return r;
+	if (!(lk = kmalloc(sizeof(*lk), GFP_KERNEL)))
+		return -ENOMEM;
+	lk->start = range.start;
+	lk->end = range.start + range.count;
+	lk->blockers = 0;
+	lk->writable = (filp->f_mode & FMODE_WRITE) != 0;
+	lk->granted = 0;
+	lk->pid = current->pid;
+	lk->filp = filp;
+	lk->wait.lock = NULL;
+	lk->wait.pid = current->pid;
+
+	osp_spin_lock(&d->mutex);
+	// A range writer must see the fast-path readers
+	if (lk->writable)
+		osprd_drain_readers(d);
+	for_each_range_lock(l, n, d, lk->start, lk->end) {
+		if (l->pid == current->pid) {
+			r = try ? -EBUSY : -EDEADLK;
+			break;
 		}
+		if (range_conflicts(l, lk))
+			lk->blockers++;
+	}
+	wait = lk->blockers || !range_device_ok(d, lk);
+	lk->ticket = d->range_ticket;
+	if (r == 0 && wait && try)
+		r = -EBUSY;
+	else if (r == 0 && wait && check_deadlock_waiter(&lk->wait))
+		r = -EDEADLK;
+	if (r == 0) {
+		d->range_ticket++;
+		range_insert(d, lk, wait);
+	}
+	osprd_restore_bias(d);
+	osp_spin_unlock(&d->mutex);
 
-		// This line avoids compiler warnings; you may remove it.
-		(void) filp_writable, (void) d;
-
+	if (r != 0) {
+		kfree(lk);
+		return r;
 	}
 
+	if (wait_event_interruptible(d->range_blockq, lk->granted)) {
+		osp_spin_lock(&d->mutex);
+		if (range_remove(d, lk))
+			wake_up_all(&d->range_blockq);
+		osp_spin_unlock(&d->mutex);
+		return -ERESTARTSYS;
+	}
 	return 0;
 }
 
-
-int check_deadlock(osprd_info_t *d) {
-	// aleady got the spin_lock in d
-	int r = 0;
-	if (has_pid(&d->locking_procs, current->pid)) {
-		r = 1;
-	} else {
-		struct pid_list dependencies;
-		pid_node_t p;
-		int i;
-		dependencies.head = NULL;
-		dependencies.tail = NULL;
-		p = d->locking_procs.head;
-		while (p) {
-			add_pid(&dependencies, p->pid, p->ticket);
-			p = p->next;
-		}
-
-		for (i = 0; i < NOSPRD; i ++) {
-			osprd_info_t *od = &osprds[i];
-			if (od == d)
-				continue;
-			
-			osp_spin_lock(&od->mutex);
-			p = dependencies.head;
-			while (p) {
-				pid_node_t op;
-				op = has_pid_r(&od->locking_procs, p->pid);
-				if (op) {
-					if (has_pid_until(&od->locking_procs, current->pid, op)) {
-						r = 1;
-						break;
-					}
-				}
-
-				p = p->next;
-			}
-			osp_spin_unlock(&od->mutex);
-
-			if (r != 0) {
-				break;
-			}
+/*
+ * osprd_range_release(d, filp, arg)
+ *   Release the range lock that 'filp' holds on the struct osprd_range at
+ *   'arg'.  Returns -EINVAL if it holds no such lock.
+ */
+static int osprd_range_release(osprd_info_t *d, struct file *filp,
+			       unsigned long arg)
+{
+	struct osprd_range range;
+	osprd_range_lock_t *l;
+	struct rb_node *n;
+	int r, wake = 0;
+
+	if ((r = copy_range(d, &range, arg)) < 0)
+		return r;
+
+	r = -EINVAL;
+	osp_spin_lock(&d->mutex);
+	for_each_range_lock(l, n, d, range.start, range.start + 1)
+		if (l->filp == filp && l->start == range.start
+		    && l->end == range.start + range.count && l->granted) {
+			wake = range_remove(d, l);
+			r = 0;
+			break;
 		}
+	if (wake)
+		wake_up_all(&d->range_blockq);
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
 
-		clean_pid_list(&dependencies);
+/*
+ * osprd_range_release_all(d, filp)
+ *   Release every range lock that 'filp' holds.
+ */
+static void osprd_range_release_all(osprd_info_t *d, struct file *filp)
+{
+	struct rb_node *n, *next;
+	int wake = 0;
+
+	osp_spin_lock(&d->mutex);
+	for (n = rb_first(&d->range_locks); n; n = next) {
+		osprd_range_lock_t *l = rb_entry(n, osprd_range_lock_t, node);
+		next = rb_next(n);
+		if (l->filp == filp)
+			wake |= range_remove(d, l);
 	}
-
-	return r;
+	if (wake)
+		wake_up_all(&d->range_blockq);
+	osp_spin_unlock(&d->mutex);
 }
 
+
 /*
  * osprd_lock
  */
@@ -443,7 +2019,7 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// to write-lock the ramdisk; otherwise attempt to read-lock
 		// the ramdisk.
 		//
-                // This lock request must block using 'd->blockq' until:
+                // This lock request must block (see osprd_waiter) until:
 		// 1) no other process holds a write lock;
 		// 2) either the request is for a read lock, or no other process
 		//    holds a read lock; and
@@ -456,7 +2032,7 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 		// keep track of how many read and write locks are held:
 		// change the 'osprd_info_t' structure to do this.
 		//
-		// Also wake up processes waiting on 'd->blockq' as needed.
+		// Also wake up processes waiting on 'd->waiters' as needed.
 		//
 		// If the lock request would cause a deadlock, return -EDEADLK.
 		// If the lock request blocks and is awoken by a signal, then
@@ -474,58 +2050,107 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 		// Your code here (instead of the next two lines).
 		//eprintk("Attempting to acquire\n");
-		unsigned local_ticket;
+		struct osprd_waiter w;
+		pid_node_t holder;
 
-		//eprintk("read_lock_cnt=%d, write_lock_cnt=%d\n", d->read_lock_cnt, d->write_lock_cnt);
+		//eprintk("read_lock_cnt=%d, write_lock_cnt=%d\n", d->lock.read_lock_cnt, d->lock.write_lock_cnt);
 
-		osp_spin_lock(&d->mutex);
-		//if (has_pid(&d->locking_procs, current->pid)) {
-		if (check_deadlock(d)) {
-			r = -EDEADLK;
-		} else {
-			local_ticket = d->ticket_head;
-			d->ticket_head ++;
-			add_pid(&d->locking_procs, current->pid, local_ticket);
+		if (!filp_writable && (r = osprd_read_lock_fast(d)) > 0) {
+			filp->f_flags |= F_OSPRD_LOCKED;
+			return 0;
+		} else if (r < 0) {
+			osprd_stat_inc(&d->lock, deadlocks);
+			return r;
 		}
+
+		// Our entry in 'locking_procs' once we hold the lock
+		if (!(holder = kmalloc(sizeof(*holder), GFP_KERNEL)))
+			return -ENOMEM;
+
+		osp_spin_lock(&d->mutex);
+		osprd_drain_readers(d);
+		w.task = current;
+		w.filp = NULL;
+		r = osprd_lock_acquire(&d->lock, &w, holder, current->pid,
+				       filp_writable);
+		osprd_restore_bias(d);
 		osp_spin_unlock(&d->mutex);
 
 		if (r != 0) {
 			// return upon deadlock
-			//wake_up_all(&d->blockq);
+			kfree(holder);
 			return r;
 		}
 
-		r = wait_event_interruptible(d->blockq, 
-				d->mutex.lock == 0 // cannot osp_spin_lock() here!
-				&& d->write_lock_cnt == 0 // no writer before current proc
-				&& (!filp_writable	// current proc is reader 
-					|| d->read_lock_cnt == 0) // no reader before current proc (writer)
-				&& d->ticket_tail == local_ticket // it's the turn for the ticket of current proc
-				);
-
+		// Sleep until osprd_grant_waiters() gives us the lock.
+		// set_current_state() comes first so that a grant after our
+		// check still wakes us.
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (w.granted || signal_pending(current))
+				break;
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
 
-		if (r != 0) {
+		osp_spin_lock(&d->mutex);
+		d->lock.nwaiters --;
+		if (!w.granted) {
 			// return by signal
-			add_ticket(&d->invalid_tickets, local_ticket);
-			find_next_valid_ticket(&d->invalid_tickets, &d->ticket_tail, 0);
-			remove_pid_ticket(&d->locking_procs, current->pid, local_ticket);
+			osprd_lock_abandon(&d->lock, &w);
+			kfree(holder);
+			osprd_stat_inc(&d->lock, interrupted);
 			r = -ERESTARTSYS;
 		} else {
-			osp_spin_lock(&d->mutex);
-			filp->f_flags |= F_OSPRD_LOCKED; // this is locking the ramdisk
-			if (filp_writable) {
-				d->write_lock_cnt ++;
-			} else {
-				d->read_lock_cnt ++;
-			}
-
-			find_next_valid_ticket(&d->invalid_tickets, &d->ticket_tail, 1);
-			osp_spin_unlock(&d->mutex);
+			// this is locking the ramdisk
+			filp->f_flags |= osprd_lock_flags(filp_writable);
 			r = 0;
 		}
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+
+
+	} else if (cmd == OSPRDIOCACQUIREASYNC) {
+
+		// Like OSPRDIOCACQUIRE, but return at once.  The waiter stays
+		// queued after we return, and osprd_lock_wake() marks the
+		// file locked and wakes its poll()ers.
+		struct osprd_waiter *w;
+		pid_node_t holder;
+
+		if (!filp_writable && (r = osprd_read_lock_fast(d)) > 0) {
+			filp->f_flags |= F_OSPRD_LOCKED;
+			return 0;
+		} else if (r < 0) {
+			osprd_stat_inc(&d->lock, deadlocks);
+			return r;
+		}
 
-		wake_up_all(&d->blockq);
+		w = kmalloc(sizeof(*w), GFP_KERNEL);
+		holder = kmalloc(sizeof(*holder), GFP_KERNEL);
+		if (!w || !holder) {
+			kfree(w);
+			kfree(holder);
+			return -ENOMEM;
+		}
+
+		osp_spin_lock(&d->mutex);
+		osprd_drain_readers(d);
+		if (osprd_async_waiter(d, filp))
+			r = -EBUSY;
+		else {
+			w->task = NULL;
+			w->filp = filp;
+			r = osprd_lock_acquire(&d->lock, w, holder, current->pid,
+					       filp_writable);
+		}
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
 
+		if (r != 0) {
+			kfree(w);
+			kfree(holder);
+		}
 
 	} else if (cmd == OSPRDIOCTRYACQUIRE) {
 
@@ -538,31 +2163,26 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 		// Your code here (instead of the next two lines).
 		//eprintk("Attempting to try acquire");
-	
-		unsigned local_ticket;
+
+		// Where OSPRDIOCACQUIRE would deadlock, we're just busy
+		if (!filp_writable && (r = osprd_read_lock_fast(d)) > 0) {
+			filp->f_flags |= F_OSPRD_LOCKED;
+			return 0;
+		} else if (r < 0) {
+			osprd_stat_inc(&d->lock, try_failures);
+			return -EBUSY;
+		}
+
 		osp_spin_lock(&d->mutex); // we can do this here because this branch not to block
-		local_ticket = d->ticket_head ++;		
-		if (d->write_lock_cnt == 0 
-				&& (!filp_writable || d->read_lock_cnt == 0)) {
-			// grab the log immediately
-			filp->f_flags |= F_OSPRD_LOCKED; // this is locking the ramdisk
-			if (filp_writable) {
-				d->write_lock_cnt ++;
-			} else {
-				d->read_lock_cnt ++;
-			}
-			add_pid(&d->locking_procs, current->pid, local_ticket);
-			// nobody waiting so no need to update ticket
-			// this one never wait so no need to set  a local_ticket
-			r = 0;
-		} else {
-			r = -EBUSY;		
+		osprd_drain_readers(d);
+		r = osprd_lock_try(&d->lock, current->pid, filp_writable);
+		if (r == 0) {
+			// this is locking the ramdisk
+			filp->f_flags |= osprd_lock_flags(filp_writable);
 		}
-		d->ticket_tail = local_ticket + 1;
+		osprd_restore_bias(d);
 		osp_spin_unlock(&d->mutex);
 
-		wake_up_all(&d->blockq);		
-
 	} else if (cmd == OSPRDIOCRELEASE) {
 
 		// EXERCISE: Unlock the ramdisk.
@@ -574,24 +2194,117 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 		// Your code here (instead of the next line).
 		//eprintk("release: writable");
-		osp_spin_lock(&d->mutex);
-		if (filp->f_flags & F_OSPRD_LOCKED) {
+
+		if ((filp->f_flags & F_OSPRD_LOCKED)
+		    && !(filp->f_flags & F_OSPRD_WRITE_LOCKED)
+		    && osprd_read_unlock_fast(d)) {
 			filp->f_flags &= ~F_OSPRD_LOCKED;
-			if (filp_writable) {
-				d->write_lock_cnt --;
-			} else {
-				d->read_lock_cnt --;
-			}
+			osprd_unmap(d, filp->f_mapping, 0, 0);
+			return 0;
+		}
 
-			
+		osp_spin_lock(&d->mutex);
+		if (!(filp->f_flags & F_OSPRD_LOCKED)
+		    && osprd_cancel_async(d, filp)) {
+			// An acquire still pending is cancelled instead
+			osprd_restore_bias(d);
+			osp_spin_unlock(&d->mutex);
+			return 0;
+		}
+		if (filp->f_flags & F_OSPRD_LOCKED) {
+			osprd_lock_release(&d->lock, current->pid,
+					   filp->f_flags & F_OSPRD_WRITE_LOCKED);
+			filp->f_flags &= ~osprd_lock_flags(1);
+			range_grant_all(d);
 		} else {
 			// non-lock holder try to release; give some error
 			r = -EINVAL;
 		}
-		remove_pid(&d->locking_procs, current->pid);
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+		if (r == 0)
+			osprd_unmap(d, filp->f_mapping, 0, 0);
+
+	} else if (cmd == OSPRDIOCUPGRADE) {
+
+		// Trade our read lock for the write lock (see
+		// osprd_lock_upgrade).
+		struct osprd_waiter w;
+
+		if ((filp->f_flags & osprd_lock_flags(1)) != F_OSPRD_LOCKED)
+			return -EINVAL;
+
+		osp_spin_lock(&d->mutex);
+		osprd_drain_readers(d);
+		w.task = current;
+		w.filp = NULL;
+		r = osprd_lock_upgrade(&d->lock, &w, current->pid);
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+		if (r != 0)
+			return r;
+
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (w.granted || signal_pending(current))
+				break;
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+
+		osp_spin_lock(&d->mutex);
+		d->lock.nwaiters --;
+		if (!w.granted) {
+			// return by signal, still holding the read lock
+			osprd_lock_abandon(&d->lock, &w);
+			range_grant_all(d);
+			osprd_stat_inc(&d->lock, interrupted);
+			r = -ERESTARTSYS;
+		} else
+			filp->f_flags |= F_OSPRD_WRITE_LOCKED;
+		osprd_restore_bias(d);
+		osp_spin_unlock(&d->mutex);
+
+	} else if (cmd == OSPRDIOCDOWNGRADE) {
+
+		// Trade our write lock for a read lock, and let in the
+		// readers at the head of the queue with us.
+		if (!(filp->f_flags & F_OSPRD_WRITE_LOCKED))
+			return -EINVAL;
+
+		osp_spin_lock(&d->mutex);
+		filp->f_flags &= ~F_OSPRD_WRITE_LOCKED;
+		osprd_lock_downgrade(&d->lock);
+		range_grant_all(d);
+		osprd_restore_bias(d);
 		osp_spin_unlock(&d->mutex);
+		// Writable mappings must fault, and fail, from now on
+		osprd_unmap(d, filp->f_mapping, 0, 0);
+
+	} else if (cmd == OSPRDIOCACQUIRERANGE
+		   || cmd == OSPRDIOCTRYACQUIRERANGE) {
+
+		r = osprd_range_acquire(d, filp, arg,
+					cmd == OSPRDIOCTRYACQUIRERANGE);
 
-		wake_up_all(&d->blockq);
+	} else if (cmd == OSPRDIOCRELEASERANGE) {
+
+		r = osprd_range_release(d, filp, arg);
+
+	} else if (cmd == OSPRDIOCACQUIREVEC || cmd == OSPRDIOCTRYACQUIREVEC) {
+
+		r = osprd_lock_vector(arg, cmd == OSPRDIOCTRYACQUIREVEC);
+
+	} else if (cmd == OSPRDIOCSNAPSHOT) {
+
+		r = osprd_snapshot(d, inode->i_bdev);
+
+	} else if (cmd == BLKDISCARD || cmd == BLKZEROOUT) {
+
+		if (!filp_writable)
+			r = -EBADF;
+		else
+			r = osprd_zero_range(d, inode->i_bdev, arg);
 
 	} else
 		r = -ENOTTY; /* unknown command */
@@ -603,16 +2316,17 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 static void osprd_setup(osprd_info_t *d)
 {
-	/* Initialize the wait queue. */
-	init_waitqueue_head(&d->blockq);
+	/* Initialize the wait list. */
+	osprd_lock_init(&d->lock);
 	osp_spin_lock_init(&d->mutex);
-	d->ticket_head = d->ticket_tail = 0;
 	/* Add code here if you add fields to osprd_info_t. */
-	d->write_lock_cnt = 0;
-	d->read_lock_cnt = 0;
-	d->invalid_tickets.head = NULL;
-	d->locking_procs.head = NULL;
-	d->locking_procs.tail = NULL;
+	d->range_locks = RB_ROOT;
+	d->range_ticket = 0;
+	d->range_writers = 0;
+	init_waitqueue_head(&d->range_blockq);
+	init_waitqueue_head(&d->pollq);
+	atomic_set(&d->mapped, 0);
+	d->reader_bias = 1;
 }
 
 
@@ -643,17 +2357,41 @@ static int (*blkdev_release)(struct inode *, struct file *);
 
 static int _osprd_release(struct inode *inode, struct file *filp)
 {
-	if (file2osprd(filp))
+	osprd_info_t *d = file2osprd(filp);
+	int r;
+	if (d)
 		osprd_close_last(inode, filp);
-	return (*blkdev_release)(inode, filp);
+	r = (*blkdev_release)(inode, filp);
+	if (d) {
+		mutex_lock(&osprd_devices_lock);
+		d->users--;
+		mutex_unlock(&osprd_devices_lock);
+	}
+	return r;
 }
 
 static int _osprd_open(struct inode *inode, struct file *filp)
 {
+	// The disk may be going away: only trust its private_data once the
+	// device table says it is still there.
+	struct gendisk *gd = inode->i_bdev->bd_disk;
+	osprd_info_t *d;
+	mutex_lock(&osprd_devices_lock);
+	d = osprds[gd->first_minor];
+	if (d && (d->gd != gd || d->dying))
+		d = NULL;
+	if (d)
+		d->users++;
+	mutex_unlock(&osprd_devices_lock);
+	if (!d)
+		return -ENXIO;
+
 	if (!osprd_blk_fops.open) {
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		osprd_blk_fops.poll = osprd_poll;
+		osprd_blk_fops.mmap = osprd_mmap;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
@@ -713,11 +2451,114 @@ static void for_each_open_file(struct task_struct *task,
 }
 
 
+// Set up the compressed store: each CPU's page buffers and zlib streams,
+// which deflate raw (no header or checksum) at the fastest level.
+
+static int osprd_zsetup(osprd_info_t *d)
+{
+	struct osprd_zscratch *zs;
+	int cpu;
+
+	if (!(d->zscratch = alloc_percpu(struct osprd_zscratch)))
+		return -1;
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(d->zscratch, cpu);
+		if (!(zs->def.workspace = vmalloc(zlib_deflate_workspacesize()))
+		    || !(zs->inf.workspace = vmalloc(zlib_inflate_workspacesize()))
+		    || zlib_deflateInit2(&zs->def, Z_BEST_SPEED, Z_DEFLATED,
+					 -MAX_WBITS, DEF_MEM_LEVEL,
+					 Z_DEFAULT_STRATEGY) != Z_OK
+		    || zlib_inflateInit2(&zs->inf, -MAX_WBITS) != Z_OK)
+			return -1;
+	}
+	return 0;
+}
+
+static void osprd_zcleanup(osprd_info_t *d)
+{
+	struct osprd_zscratch *zs;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		zs = per_cpu_ptr(d->zscratch, cpu);
+		if (zs->def.workspace) {
+			zlib_deflateEnd(&zs->def);
+			vfree(zs->def.workspace);
+		}
+		if (zs->inf.workspace) {
+			zlib_inflateEnd(&zs->inf);
+			vfree(zs->inf.workspace);
+		}
+	}
+	free_percpu(d->zscratch);
+}
+
+
+// A disk's name, like "osprda"; 'buf' holds 32 bytes.
+
+static void osprd_disk_name(char *buf, int which)
+{
+	if (which < 26)
+		snprintf(buf, 32, "osprd%c", which + 'a');
+	else
+		snprintf(buf, 32, "osprd%d", which);
+}
+
+
+// Open the backing file of disk 'which' and start its flusher thread.
+
+static int osprd_backing_setup(osprd_info_t *d, int which)
+{
+	unsigned long npages = DIV_ROUND_UP(d->nsectors, PAGE_SECTORS);
+	unsigned long size = BITS_TO_LONGS(npages) * sizeof(long);
+	struct file *f;
+	char *path;
+
+	mutex_init(&d->fault_lock);
+	if (!(d->loaded = vmalloc(size)) || !(d->dirty = vmalloc(size))
+	    || !(d->fault_buf = kmalloc(PAGE_SIZE, GFP_KERNEL))
+	    || !(d->flush_buf = vmalloc(OSPRD_FLUSH_BATCH * PAGE_SIZE))
+	    || !(path = kmalloc(strlen(backing) + 34, GFP_KERNEL)))
+		return -1;
+	memset(d->loaded, 0, size);
+	memset(d->dirty, 0, size);
+
+	sprintf(path, "%s/", backing);
+	osprd_disk_name(path + strlen(path), which);
+	f = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(f)) {
+		eprintk("osprd: can't open backing file %s: error %ld\n",
+			path, PTR_ERR(f));
+		kfree(path);
+		return -1;
+	}
+	kfree(path);
+	d->backing_file = f;
+
+	d->flusher = kthread_run(osprd_flusher, d, "osprd-flush/%d", which);
+	if (IS_ERR(d->flusher)) {
+		d->flusher = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
 // Destroy a osprd_info_t.
 
 static void cleanup_device(osprd_info_t *d)
 {
-	wake_up_all(&d->blockq);
+	// Write back what the flusher hasn't yet.  The disk is closed.
+	if (d->flusher)
+		kthread_stop(d->flusher);
+	if (d->backing_file) {
+		osprd_flush(d);
+		filp_close(d->backing_file, NULL);
+	}
+	vfree(d->loaded);
+	vfree(d->dirty);
+	kfree(d->fault_buf);
+	vfree(d->flush_buf);
 	if (d->gd) {
 		del_gendisk(d->gd);
 		put_disk(d->gd);
@@ -726,27 +2567,91 @@ static void cleanup_device(osprd_info_t *d)
 		blk_cleanup_queue(d->queue);
 	if (d->data)
 		vfree(d->data);
+	else
+		osprd_free_pages(&d->pages, d->zscratch != NULL);
+	osprd_put_layer(d->base);
+	if (d->zscratch)
+		osprd_zcleanup(d);
+	if (d->readers) {
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			struct osprd_readers *rc = per_cpu_ptr(d->readers, cpu);
+			pid_node_t p;
+			clean_pid_list(&rc->pids);
+			while ((p = rc->spare)) {
+				rc->spare = p->next;
+				kfree(p);
+			}
+		}
+		free_percpu(d->readers);
+	}
+	if (d->lock.stats)
+		free_percpu(d->lock.stats);
 }
 
 
-// Initialize a osprd_info_t.
+// Initialize a osprd_info_t.  A snapshot starts out reading through
+// the layer 'base', whose reference it takes over.
 
-static int setup_device(osprd_info_t *d, int which)
+static int setup_device(osprd_info_t *d, int which, sector_t nsect,
+			struct osprd_layer *base)
 {
+	int cpu;
+
 	memset(d, 0, sizeof(osprd_info_t));
+	d->nsectors = nsect;
+	d->base = base;
+
+	/* Get memory to store the actual block data, or set up the sparse
+	 * store, which allocates pages as they are first written, and
+	 * maybe compresses them. */
+	if (sparse || compress) {
+		INIT_RADIX_TREE(&d->pages, GFP_ATOMIC);
+		spin_lock_init(&d->page_lock);
+		if (compress && osprd_zsetup(d) < 0)
+			return -1;
+	} else {
+		unsigned long size = (unsigned long) nsect * SECTOR_SIZE;
+		if (!(d->data = vmalloc(size)))
+			return -1;
+		memset(d->data, 0, size);
+	}
+
+	/* The backing file, for the disks made at load time (or remade
+	 * later with their minor numbers) but not for snapshots. */
+	if (backing && which < ndevices && !base
+	    && osprd_backing_setup(d, which) < 0)
+		return -1;
 
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* Per-CPU counters for the reader fast path. */
+	if (!(d->readers = alloc_percpu(struct osprd_readers)))
+		return -1;
+	if (!(d->lock.stats = alloc_percpu(struct osprd_lockstats)))
 		return -1;
-	memset(d->data, 0, nsectors * SECTOR_SIZE);
+	for_each_possible_cpu(cpu) {
+		struct osprd_readers *rc = per_cpu_ptr(d->readers, cpu);
+		spin_lock_init(&rc->lock);
+		rc->count = 0;
+		rc->pids.head = rc->pids.tail = NULL;
+		rc->spare = NULL;
+		rc->nspare = 0;
+	}
 
-	/* Set up the I/O queue. */
+	/* Set up the I/O queue, or just a bio entry point (see use_bio). */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+	if (use_bio || d->backing_file) {
+		if (!(d->queue = blk_alloc_queue(GFP_KERNEL)))
+			return -1;
+		blk_queue_make_request(d->queue, osprd_make_request);
+	} else if (!(d->queue = blk_init_queue(osprd_process_request_queue,
+					       &d->qlock)))
 		return -1;
 	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
 	d->queue->queuedata = d;
 
+	/* Call the setup function, before the disk can be opened. */
+	osprd_setup(d);
+
 	/* The gendisk structure. */
 	if (!(d->gd = alloc_disk(1)))
 		return -1;
@@ -755,21 +2660,255 @@ static int setup_device(osprd_info_t *d, int which)
 	d->gd->fops = &osprd_ops;
 	d->gd->queue = d->queue;
 	d->gd->private_data = d;
-	snprintf(d->gd->disk_name, 32, "osprd%c", which + 'a');
-	set_capacity(d->gd, nsectors);
+	osprd_disk_name(d->gd->disk_name, which);
+	set_capacity(d->gd, nsect);
 	add_disk(d->gd);
 
-	/* Call the setup function. */
-	osprd_setup(d);
-
 	return 0;
 }
 
 static void osprd_exit(void);
 
 
+// Create a ramdisk of 'nsect' sectors with the lowest free minor number,
+// on top of snapshot layer 'base' (or NULL).  The reference to 'base' is
+// the new disk's, or is dropped on failure.
+// Returns the minor number, or a negative error code.
+
+static int osprd_create(sector_t nsect, struct osprd_layer *base)
+{
+	osprd_info_t *d;
+	int minor;
+
+	if (!(d = kmalloc(sizeof(osprd_info_t), GFP_KERNEL))) {
+		osprd_put_layer(base);
+		return -ENOMEM;
+	}
+	memset(d, 0, sizeof(osprd_info_t));
+
+	// Claim the minor number first; opens fail until d->gd is set.
+	mutex_lock(&osprd_devices_lock);
+	for (minor = 0; minor < OSPRD_MAX_DEVICES && osprds[minor]; minor++)
+		/* nothing */;
+	if (minor < OSPRD_MAX_DEVICES)
+		osprds[minor] = d;
+	mutex_unlock(&osprd_devices_lock);
+	if (minor == OSPRD_MAX_DEVICES) {
+		kfree(d);
+		osprd_put_layer(base);
+		return -ENOSPC;
+	}
+
+	if (setup_device(d, minor, nsect, base) < 0) {
+		mutex_lock(&osprd_devices_lock);
+		osprds[minor] = NULL;
+		mutex_unlock(&osprd_devices_lock);
+		cleanup_device(d);
+		kfree(d);
+		return -ENOMEM;
+	}
+	return minor;
+}
+
+
+// Destroy the ramdisk with minor number 'minor', unless it is open.
+
+static int osprd_destroy(int minor)
+{
+	osprd_info_t *d = NULL;
+	int r = 0;
+
+	mutex_lock(&osprd_devices_lock);
+	if (minor < 0 || minor >= OSPRD_MAX_DEVICES
+	    || !(d = osprds[minor]) || !d->gd || d->dying)
+		r = -ENXIO;
+	else if (d->users)
+		r = -EBUSY;
+	else
+		d->dying = 1;
+	mutex_unlock(&osprd_devices_lock);
+
+	// Keep the minor number until the disk, its device number and its
+	// flusher are gone, so a disk created meanwhile can't collide with it.
+	if (r == 0) {
+		cleanup_device(d);
+		mutex_lock(&osprd_devices_lock);
+		osprds[minor] = NULL;
+		mutex_unlock(&osprd_devices_lock);
+		kfree(d);
+	}
+	return r;
+}
+
+
+// The control device, /dev/osprdctl, creates and destroys ramdisks.
+
+static int osprd_ctl_ioctl(struct inode *inode, struct file *filp,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct osprd_create c;
+	int r;
+
+	if (cmd == OSPRDCTLCREATE) {
+		if (copy_from_user(&c, (void __user *) arg, sizeof(c)))
+			return -EFAULT;
+		if (c.nsectors == 0)
+			c.nsectors = nsectors;
+		if (c.nsectors > ULONG_MAX / SECTOR_SIZE)
+			return -EINVAL;
+		if ((r = osprd_create(c.nsectors, NULL)) < 0)
+			return r;
+		c.minor = r;
+		if (copy_to_user((void __user *) arg, &c, sizeof(c)))
+			return -EFAULT;
+		return 0;
+	} else if (cmd == OSPRDCTLDESTROY)
+		return osprd_destroy((int) arg);
+	else
+		return -ENOTTY;
+}
+
+static struct file_operations osprd_ctl_fops = {
+	.owner = THIS_MODULE,
+	.ioctl = osprd_ctl_ioctl
+};
+
+static struct miscdevice osprd_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "osprdctl",
+	.fops = &osprd_ctl_fops
+};
+static int osprd_ctl_registered;
+
+
+// /proc/driver/osprd shows each disk's size and, for the compressed
+// store, how well it compresses.
+
+static int osprd_proc_show(struct seq_file *m, void *v)
+{
+	unsigned long zpages, zsame, orig_kb, used_kb;
+	int i;
+
+	mutex_lock(&osprd_devices_lock);
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++) {
+		osprd_info_t *d = osprds[i];
+		if (!d || !d->gd || d->dying)
+			continue;
+		seq_printf(m, "%s: %lu sectors", d->gd->disk_name,
+			   (unsigned long) d->nsectors);
+		if (d->zscratch) {
+			spin_lock(&d->page_lock);
+			zpages = d->zpages;
+			zsame = d->zsame;
+			used_kb = (d->zbytes + zpages * sizeof(struct osprd_zpage)
+				   + 1023) / 1024;
+			spin_unlock(&d->page_lock);
+			orig_kb = zpages * (PAGE_SIZE / 1024);
+			seq_printf(m, ", %lu pages (%lu same-filled),"
+				   " %lu KB compressed to %lu KB",
+				   zpages, zsame, orig_kb, used_kb);
+			if (used_kb)
+				seq_printf(m, ", ratio %lu.%02lu",
+					   orig_kb / used_kb,
+					   orig_kb * 100 / used_kb % 100);
+		}
+		seq_puts(m, "\n");
+	}
+	mutex_unlock(&osprd_devices_lock);
+	return 0;
+}
+
+static int osprd_proc_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, osprd_proc_show, NULL);
+}
+
+static struct file_operations osprd_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = osprd_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+static struct proc_dir_entry *osprd_proc;
+
+
+// Print the nonzero buckets of a log2 histogram as "RANGE:COUNT".
+static void osprd_show_hist(struct seq_file *m, const char *name,
+			    const unsigned long *hist)
+{
+	int b;
+
+	seq_printf(m, "  %s", name);
+	for (b = 0; b < OSPRD_HIST_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (b <= 1)
+			seq_printf(m, " %d:%lu", b, hist[b]);
+		else
+			seq_printf(m, " %lu-%lu:%lu", 1UL << (b - 1),
+				   (1UL << b) - 1, hist[b]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int osprd_locks_show(struct seq_file *m, void *v)
+{
+	struct osprd_lockstats sum, *s;
+	unsigned depth;
+	int i, b, cpu;
+
+	mutex_lock(&osprd_devices_lock);
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++) {
+		osprd_info_t *d = osprds[i];
+		if (!d || !d->gd || d->dying)
+			continue;
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			s = per_cpu_ptr(d->lock.stats, cpu);
+			sum.acquires += s->acquires;
+			sum.try_failures += s->try_failures;
+			sum.deadlocks += s->deadlocks;
+			sum.interrupted += s->interrupted;
+			for (b = 0; b < OSPRD_HIST_BUCKETS; b++) {
+				sum.wait_us[b] += s->wait_us[b];
+				sum.hold_us[b] += s->hold_us[b];
+				sum.depth[b] += s->depth[b];
+			}
+		}
+		osp_spin_lock(&d->mutex);
+		depth = d->lock.ticket_head - d->lock.ticket_tail;
+		osp_spin_unlock(&d->mutex);
+
+		seq_printf(m, "%s: %lu acquires, %lu try failures,"
+			   " %lu deadlocks, %lu interrupted, %u waiting\n",
+			   d->gd->disk_name, sum.acquires, sum.try_failures,
+			   sum.deadlocks, sum.interrupted, depth);
+		osprd_show_hist(m, "wait_us", sum.wait_us);
+		osprd_show_hist(m, "hold_us", sum.hold_us);
+		osprd_show_hist(m, "depth", sum.depth);
+	}
+	mutex_unlock(&osprd_devices_lock);
+	return 0;
+}
+
+static int osprd_locks_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, osprd_locks_show, NULL);
+}
+
+static struct file_operations osprd_locks_fops = {
+	.owner = THIS_MODULE,
+	.open = osprd_locks_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+static struct proc_dir_entry *osprd_locks_proc;
+
+
 // The kernel calls this function when the module is loaded.
-// It initializes the 4 osprd block devices.
+// It initializes the first 'ndevices' osprd block devices.
 
 static int __init osprd_init(void)
 {
@@ -789,9 +2928,19 @@ static int __init osprd_init(void)
 	}
 
 	/* Initialize the device structures. */
-	for (i = r = 0; i < NOSPRD; i++)
-		if (setup_device(&osprds[i], i) < 0)
+	for (i = r = 0; i < ndevices && i < OSPRD_MAX_DEVICES; i++)
+		if (osprd_create(nsectors, NULL) < 0)
 			r = -EINVAL;
+	if (r == 0 && misc_register(&osprd_ctl) < 0)
+		r = -EINVAL;
+	else if (r == 0)
+		osprd_ctl_registered = 1;
+	if (r == 0 && (osprd_proc = create_proc_entry("driver/osprd", S_IRUGO,
+						      NULL)))
+		osprd_proc->proc_fops = &osprd_proc_fops;
+	if (r == 0 && (osprd_locks_proc = create_proc_entry("driver/osprd_locks",
+							    S_IRUGO, NULL)))
+		osprd_locks_proc->proc_fops = &osprd_locks_fops;
 
 	if (r < 0) {
 		printk(KERN_EMERG "osprd: can't set up device structures\n");
@@ -808,8 +2957,18 @@ static int __init osprd_init(void)
 static void osprd_exit(void)
 {
 	int i;
-	for (i = 0; i < NOSPRD; i++)
-		cleanup_device(&osprds[i]);
+	if (osprd_proc)
+		remove_proc_entry("driver/osprd", NULL);
+	if (osprd_locks_proc)
+		remove_proc_entry("driver/osprd_locks", NULL);
+	if (osprd_ctl_registered)
+		misc_deregister(&osprd_ctl);
+	for (i = 0; i < OSPRD_MAX_DEVICES; i++)
+		if (osprds[i]) {
+			cleanup_device(osprds[i]);
+			kfree(osprds[i]);
+			osprds[i] = NULL;
+		}
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
 }
 
@@ -6,4 +6,92 @@
 #define OSPRDIOCTRYACQUIRE	43
 #define OSPRDIOCRELEASE		44
 
+// Sector-range locks.  These take a pointer to a struct osprd_range and
+// lock only those sectors, so processes working on disjoint parts of a
+// ramdisk don't serialize.  The whole-device lock above conflicts with
+// every range: a write lock on the device keeps out all range locks and
+// a read lock keeps out range writers, and the other way around.
+// Waiting in a cycle of range and device locks fails with EDEADLK.  A
+// range must be released with the same start and count it was acquired
+// with.
+#define OSPRDIOCACQUIRERANGE	45
+#define OSPRDIOCTRYACQUIRERANGE	46
+#define OSPRDIOCRELEASERANGE	47
+
+struct osprd_range {
+	unsigned long long start;	// first sector
+	unsigned long long count;	// number of sectors; 0 means through
+					// the end of the device
+};
+
+// Discard and write-zeroes, numbered as in newer kernels' <linux/fs.h>.
+// The argument points to a uint64_t[2] holding the byte offset and
+// length of the range; both must be multiples of 512.  On a ramdisk a
+// discarded range reads back as zeros, so the two are equivalent.
+#ifndef BLKDISCARD
+#define BLKDISCARD		_IO(0x12,119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT		_IO(0x12,127)
+#endif
+
+// The control device, /dev/osprdctl, creates and destroys ramdisks.
+// OSPRDCTLCREATE takes a pointer to a struct osprd_create and fills in
+// the new disk's minor number: /dev/osprda is minor 0, and so on.
+// OSPRDCTLDESTROY takes a minor number, and fails with EBUSY while the
+// disk is open.
+#define OSPRDCTLCREATE		48
+#define OSPRDCTLDESTROY		49
+
+struct osprd_create {
+	unsigned long long nsectors;	// size; 0 means the module default
+	int minor;			// set on return
+};
+
+// Snapshots.  OSPRDIOCSNAPSHOT, on an open ramdisk, creates a new
+// ramdisk holding a copy of it and returns the new minor number.  The
+// two share pages until either writes them, so this is cheap at any
+// size.  It needs the sparse store (insmod osprd.ko sparse=1) and fails
+// with EINVAL otherwise.  It fails with EOPNOTSUPP on a disk with a
+// backing file.
+#define OSPRDIOCSNAPSHOT	50
+
+// Asynchronous locking.  OSPRDIOCACQUIREASYNC queues for the device lock
+// like OSPRDIOCACQUIRE but returns at once (EDEADLK if the wait would
+// deadlock, EBUSY if this file already waits).  poll() and select() on
+// the file report it readable (POLLIN) once it holds the lock.  One
+// process can so wait on many ramdisks.  OSPRDIOCRELEASE releases the
+// lock, or cancels the request if it hasn't been granted yet.
+#define OSPRDIOCACQUIREASYNC	51
+
+// Locking several ramdisks at once.  These take a pointer to a struct
+// osprd_lockvec listing open ramdisk files, and lock each one as
+// OSPRDIOCACQUIRE or OSPRDIOCTRYACQUIRE would: for writing if the file
+// is open for writing, else for reading.  They can be issued on any
+// ramdisk file.  OSPRDIOCACQUIREVEC waits for all of the files at once,
+// ahead of anybody who asks for any of them later.  So processes that
+// lock all their ramdisks this way can't deadlock each other, and one
+// that would deadlock another process gets EDEADLK before it has locked
+// anything.  Either every file ends up locked, or, on any error, none
+// of them is.  Each file is unlocked with OSPRDIOCRELEASE as usual.
+#define OSPRDIOCACQUIREVEC	52
+#define OSPRDIOCTRYACQUIREVEC	53
+
+#define OSPRD_LOCKVEC_MAX	16
+
+struct osprd_lockvec {
+	unsigned count;			// number of files
+	int fds[OSPRD_LOCKVEC_MAX];	// their descriptors
+};
+
+// Changing a held lock's mode.  OSPRDIOCUPGRADE turns the read lock
+// held through this file into a write lock.  It waits only for the
+// other readers to release, ahead of anybody queued, and fails with
+// EDEADLK if another reader is already upgrading.  OSPRDIOCDOWNGRADE
+// turns a write lock into a read lock, and lets in the readers waiting
+// at the head of the queue at once.  Either fails with EINVAL if the
+// file doesn't hold the lock in the other mode.
+#define OSPRDIOCUPGRADE		54
+#define OSPRDIOCDOWNGRADE	55
+
 #endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+#define OSPRD_MAJOR	222
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Creates and destroys OSP ramdisks.\n\
+Usage: ./osprdctl create [NSECTORS]\n\
+   or: ./osprdctl snapshot DEVICE\n\
+   or: ./osprdctl destroy DEVICE\n\
+   create makes a ramdisk of NSECTORS sectors (default: the size given\n\
+   when the module was loaded), creates its device file if needed, and\n\
+   prints the device file's name.\n\
+   snapshot makes a new ramdisk holding a copy of DEVICE, which must\n\
+   use the sparse store and have no backing file, and prints its name\n\
+   like create.\n\
+   destroy removes the ramdisk DEVICE (for instance /dev/osprde) and its\n\
+   device file.  It fails while the ramdisk is open.\n");
+	exit(status);
+}
+
+int open_ctl(void)
+{
+	int ctlfd = open("/dev/osprdctl", O_RDWR);
+	if (ctlfd == -1) {
+		perror("/dev/osprdctl");
+		exit(1);
+	}
+	return ctlfd;
+}
+
+// The kernel names disks osprda through osprdz, then osprd26 and up.
+void device_name(int minor, char *buf, size_t size)
+{
+	if (minor < 26)
+		snprintf(buf, size, "/dev/osprd%c", 'a' + minor);
+	else
+		snprintf(buf, size, "/dev/osprd%d", minor);
+}
+
+// Create the device file for minor number 'minor' if needed, and print
+// its name.
+void make_node(int minor)
+{
+	struct stat st;
+	char name[64];
+
+	device_name(minor, name, sizeof(name));
+	if (stat(name, &st) == -1
+	    && (mknod(name, S_IFBLK | 0666, makedev(OSPRD_MAJOR, minor)) == -1
+		|| chmod(name, 0666) == -1)) {
+		perror(name);
+		exit(1);
+	}
+	printf("%s\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct osprd_create c;
+	struct stat st;
+	char *end;
+	int fd, snap;
+
+	if (argc >= 2 && strcmp(argv[1], "create") == 0 && argc <= 3) {
+		c.nsectors = 0;
+		if (argc == 3) {
+			c.nsectors = strtoull(argv[2], &end, 0);
+			if (!*argv[2] || *end || c.nsectors == 0)
+				usage(1);
+		}
+		if (ioctl(open_ctl(), OSPRDCTLCREATE, &c) == -1) {
+			perror("ioctl OSPRDCTLCREATE");
+			exit(1);
+		}
+		make_node(c.minor);
+
+	} else if (argc == 3 && strcmp(argv[1], "snapshot") == 0) {
+		if ((fd = open(argv[2], O_RDONLY)) == -1) {
+			perror(argv[2]);
+			exit(1);
+		}
+		if ((snap = ioctl(fd, OSPRDIOCSNAPSHOT, NULL)) == -1) {
+			perror("ioctl OSPRDIOCSNAPSHOT");
+			exit(1);
+		}
+		make_node(snap);
+
+	} else if (argc == 3 && strcmp(argv[1], "destroy") == 0) {
+		if (stat(argv[2], &st) == -1) {
+			perror(argv[2]);
+			exit(1);
+		} else if (!S_ISBLK(st.st_mode)
+			   || major(st.st_rdev) != OSPRD_MAJOR) {
+			fprintf(stderr, "%s: not an OSP ramdisk\n", argv[2]);
+			exit(1);
+		}
+		if (ioctl(open_ctl(), OSPRDCTLDESTROY, minor(st.st_rdev)) == -1) {
+			perror("ioctl OSPRDCTLDESTROY");
+			exit(1);
+		}
+		(void) unlink(argv[2]);
+
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0
+				 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	else
+		usage(1);
+
+	exit(0);
+}
@@ -0,0 +1,758 @@
+#ifndef OSPRDLOCK_H
+#define OSPRDLOCK_H
+
+/* The device lock's state machine: the ticket queue, handing the lock
+ * to waiters, and deadlock detection.  osprd.c builds it into the
+ * driver; osprdlockstress.c builds it in user space, where the few
+ * kernel interfaces it uses are stood in for below with pthreads, so
+ * the lock can be tested and measured without booting a kernel.
+ *
+ * It knows nothing about files, sleeping, or the reader fast path.
+ * Every function here is called with the lock's device mutex held (in
+ * user space, whatever mutex the caller uses instead), and the includer
+ * defines osprd_lock_wake(), which wakes a waiter the lock was just
+ * handed to. */
+
+#ifndef __KERNEL__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		0
+#define kmalloc(size, flags)	malloc(size)
+#define kfree			free
+
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(x)	spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(l)	pthread_mutex_init((l), NULL)
+#define spin_lock		pthread_mutex_lock
+#define spin_unlock		pthread_mutex_unlock
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+
+static inline void INIT_LIST_HEAD(struct list_head *l)
+{
+	l->next = l->prev = l;
+}
+
+static inline int list_empty(const struct list_head *l)
+{
+	return l->next == l;
+}
+
+static inline void list_add_tail(struct list_head *n, struct list_head *l)
+{
+	n->next = l;
+	n->prev = l->prev;
+	l->prev->next = n;
+	l->prev = n;
+}
+
+static inline void list_del_init(struct list_head *n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	INIT_LIST_HEAD(n);
+}
+#define list_del			list_del_init
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+#define hlist_for_each_entry(tpos, pos, head, member)			\
+	for (pos = (head)->first;					\
+	     pos && ((tpos = container_of(pos, typeof(*tpos), member)), 1); \
+	     pos = pos->next)
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	if ((n->next = h->first))
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+static inline void hlist_del(struct hlist_node *n)
+{
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+}
+
+static inline unsigned long hash_long(unsigned long val, unsigned bits)
+{
+	return (uint32_t) (val * 0x9e370001UL) >> (32 - bits);
+}
+
+static inline int fls(int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+/* The time in microseconds, for the lock statistics. */
+static inline u64 osprd_usecs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Count an event, or a value in a histogram, in 'l's lock statistics.
+ * There is one copy, shared by all threads. */
+#define osprd_stat_inc(l, field) \
+	__sync_fetch_and_add(&(l)->stats->field, 1)
+#define osprd_stat_hist(l, hist, value) \
+	__sync_fetch_and_add(&(l)->stats->hist[osprd_log2(value)], 1)
+
+#else /* __KERNEL__ */
+
+/* The time in microseconds, for the lock statistics. */
+static u64 osprd_usecs(void)
+{
+	struct timespec ts;
+	getnstimeofday(&ts);
+	return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Count an event, or a value in a histogram, in 'l's lock statistics
+ * for this CPU. */
+#define osprd_stat_inc(l, field) do {					\
+		per_cpu_ptr((l)->stats, get_cpu())->field++;		\
+		put_cpu();						\
+	} while (0)
+#define osprd_stat_hist(l, hist, value) do {				\
+		per_cpu_ptr((l)->stats, get_cpu())->hist[osprd_log2(value)]++; \
+		put_cpu();						\
+	} while (0)
+
+#endif /* __KERNEL__ */
+
+
+/* Lock statistics, shown in /proc/driver/osprd_locks.  They are kept
+ * per CPU, so counting an event never bounces a cache line between
+ * CPUs; reading them sums over all CPUs.  Each histogram counts values
+ * by their log2: bucket 0 holds 0, bucket b holds [2^(b-1), 2^b). */
+#define OSPRD_HIST_BUCKETS	32
+
+struct osprd_lockstats {
+	unsigned long acquires;		// Locks granted
+	unsigned long try_failures;	// OSPRDIOCTRYACQUIRE EBUSYs
+	unsigned long deadlocks;	// Acquires refused with EDEADLK
+	unsigned long interrupted;	// Waits cut short by a signal
+	unsigned long wait_us[OSPRD_HIST_BUCKETS];	// Time to acquire
+	unsigned long hold_us[OSPRD_HIST_BUCKETS];	// Time held
+	unsigned long depth[OSPRD_HIST_BUCKETS];	// Tickets ahead of
+							// each new waiter
+};
+
+static inline unsigned osprd_log2(u64 v)
+{
+	return v >= (1U << (OSPRD_HIST_BUCKETS - 1)) ? OSPRD_HIST_BUCKETS - 1
+		: fls((int) v);
+}
+
+
+struct pid_node {
+	int pid;
+	unsigned ticket;
+	u64 since;			// When the lock was granted, in us
+	struct pid_node *next;
+	struct pid_node *prev;
+};
+typedef struct pid_node*  pid_node_t;
+
+struct pid_list {
+	pid_node_t head;
+	pid_node_t tail;
+};
+
+static inline void link_pid(struct pid_list *l, pid_node_t node) {
+	node->next = NULL;
+	node->prev = NULL;
+	if (l->head && l->tail) {
+		l->tail->next = node;
+		node->prev = l->tail;
+		l->tail = node;
+	} else {
+		l->head = node;
+		l->tail = node;
+	}
+}
+
+static inline void add_pid(struct pid_list *l, int pid, unsigned ticket) {
+	pid_node_t node = kmalloc(sizeof(struct pid_node), GFP_ATOMIC);
+	node->pid = pid;
+	node->ticket = ticket;
+	node->since = osprd_usecs();
+	link_pid(l, node);
+}
+
+static inline void splice_pid_list(struct pid_list *to,
+				   struct pid_list *from) {
+	if (!from->head) {
+		return;
+	}
+	if (to->tail) {
+		to->tail->next = from->head;
+		from->head->prev = to->tail;
+	} else {
+		to->head = from->head;
+	}
+	to->tail = from->tail;
+	from->head = NULL;
+	from->tail = NULL;
+}
+
+static inline pid_node_t has_pid(struct pid_list *l, int pid) {
+	pid_node_t p = l->head;
+	while (p && p->pid != pid) {
+		p = p->next;
+	}
+	return p;
+}
+
+static inline void unlink_pid(struct pid_list *l, pid_node_t p) {
+	if (p == l->head) {
+		l->head = p->next;
+	}
+	if (p == l->tail) {
+		l->tail = p->prev;
+	}
+	if (p->prev) {
+		p->prev->next = p->next;
+	}
+	if (p->next) {
+		p->next->prev = p->prev;
+	}
+}
+
+static inline void remove_pid(struct pid_list *l, int pid) {
+	pid_node_t p = has_pid(l, pid);
+	if (!p) {
+		return;
+	}
+	unlink_pid(l, p);
+	kfree(p);
+}
+
+static inline void clean_pid_list(struct pid_list *l) {
+	pid_node_t p = l->head;
+	while (p) {
+		pid_node_t t = p;
+		p = p->next;
+		kfree(t);
+	}
+	l->head = NULL;
+	l->tail = NULL;
+}
+
+
+/* A task blocked in OSPRDIOCACQUIRE.  It lives on the waiting task's
+ * stack.  osprd_grant_waiters() hands the lock over and wakes just the
+ * tasks it granted, rather than waking every waiter to recheck.
+ * An OSPRDIOCACQUIREASYNC waiter is kmalloced instead, and has a 'filp'
+ * and no 'task': nobody sleeps on it, and the grant frees it.
+ * The includer may also enter waits of its own in the wait-for graph
+ * (osprd.c's range locks do) with a waiter whose 'lock' is NULL; see
+ * osprd_wfg_blockers(). */
+struct osprd_waiter {
+	struct list_head list;		// In 'l->waiters'
+	struct hlist_node hash;		// In 'osprd_waiting', by pid
+	struct osprd_lock *lock;	// The lock waited for
+	pid_t pid;
+	unsigned wfg_visit;		// Deadlock search, if 'lock' is
+	struct osprd_waiter *wfg_next;	//   NULL: last visit and worklist
+#ifdef __KERNEL__
+	struct task_struct *task;	// NULL if asynchronous
+	struct file *filp;		// The file to lock, if asynchronous
+#endif
+	u64 queued;			// When it was queued, in us
+	pid_node_t holder;		// Linked into 'locking_procs' on grant
+	unsigned ticket;
+	int writable;
+	int granted;			// Set once the lock is ours
+};
+
+/* The state of one device's lock, under the device mutex. */
+struct osprd_lock {
+	unsigned ticket_head;		// Next available ticket for
+					// the device lock
+
+	unsigned ticket_tail;		// Ticket now being served: the
+					// first waiter's, or ticket_head
+					// if nobody waits
+
+	struct osprd_waiter *upgrader;	// A reader waiting in
+					// OSPRDIOCUPGRADE; it goes first
+
+	struct list_head waiters;	// Tasks blocked on the device lock,
+					// in ticket order (osprd_waiter).
+					// A waiter that gives up just
+					// unlinks itself, so no ticket in
+					// the list is ever abandoned.
+
+	unsigned read_lock_cnt;
+	unsigned write_lock_cnt;
+	unsigned range_read_cnt;	// Locks on parts of the device held
+	unsigned range_write_cnt;	// by the includer (osprd.c's range
+					// locks); the lock conflicts with
+					// them as with its own holders
+	struct pid_list locking_procs;	// Holders of the device lock
+					// (except fast-path readers);
+					// protected by osprd_wfg_lock too
+	unsigned wfg_visit;		// Deadlock search: last visit
+	struct osprd_lock *wfg_next;	//   and the device worklist
+
+	unsigned nwaiters;		// Tasks blocked in OSPRDIOCACQUIRE
+	struct osprd_lockstats *stats;	// Lock statistics; set by the
+					// includer
+};
+
+/* The wait-for graph used to detect deadlock.  A blocked task waits on
+ * a device, and through it on that device's holders; so the graph is
+ * just each device's 'locking_procs' plus a table of blocked tasks by
+ * pid.  Both are kept up to date as locks are queued for, granted and
+ * released, under 'osprd_wfg_lock' (taken inside any device mutex), and
+ * a search never needs another device's mutex.  The includer's range
+ * locks add edges of their own through osprd_wfg_holders() and
+ * osprd_wfg_blockers(), from state it also keeps under the lock. */
+#define OSPRD_WAIT_HASH_BITS	6
+static struct hlist_head osprd_waiting[1 << OSPRD_WAIT_HASH_BITS];
+static DEFINE_SPINLOCK(osprd_wfg_lock);
+static unsigned osprd_wfg_visit;
+
+#define osprd_waiting_head(pid) \
+	(&osprd_waiting[hash_long((pid), OSPRD_WAIT_HASH_BITS)])
+
+/* Wake 'w', which osprd_grant_waiters() just handed the lock to.
+ * Defined by the includer; called with the device mutex held. */
+static void osprd_lock_wake(struct osprd_lock *l, struct osprd_waiter *w);
+
+/* One deadlock search (see check_deadlock). */
+struct osprd_wfg_search {
+	pid_t pid;			// The process that would wait
+	struct osprd_lock *start;	// The lock it would wait for, if any
+	int writable;			//   and in which mode
+	int upgrading;			// It holds 'start' and upgrades
+	unsigned visit;
+	struct osprd_lock *work;	// Devices left to search
+	struct osprd_waiter *wwork;	// Includer waits left to search
+	int found;
+};
+
+static void osprd_wfg_follow(struct osprd_wfg_search *s, pid_t pid);
+
+/* Deadlock search hooks, defined by the includer and called with
+ * 'osprd_wfg_lock' held.  osprd_wfg_holders() calls osprd_wfg_follow()
+ * on each process that a waiter for 'l' waits for besides 'l's holders;
+ * osprd_wfg_blockers() on each process that an includer's waiter 'w'
+ * waits for. */
+static void osprd_wfg_holders(struct osprd_wfg_search *s,
+			      struct osprd_lock *l);
+static void osprd_wfg_blockers(struct osprd_wfg_search *s,
+			       struct osprd_waiter *w);
+
+
+static inline void osprd_lock_init(struct osprd_lock *l)
+{
+	INIT_LIST_HEAD(&l->waiters);
+	l->ticket_head = l->ticket_tail = 0;
+	l->upgrader = NULL;
+	l->write_lock_cnt = 0;
+	l->read_lock_cnt = 0;
+	l->range_read_cnt = l->range_write_cnt = 0;
+	l->locking_procs.head = NULL;
+	l->locking_procs.tail = NULL;
+	l->nwaiters = 0;
+}
+
+/*
+ * osprd_grant_waiters(l)
+ *   Hand the lock to the first waiter, if it can have it now, and keep
+ *   going while the next one can too; so a run of readers is granted
+ *   and woken as a batch.  Only granted tasks are woken.  Called after
+ *   anything that could let a waiter in or that changed the head of
+ *   'l->waiters'.
+ */
+static void osprd_grant_waiters(struct osprd_lock *l)
+{
+	struct osprd_waiter *w;
+	u64 now = osprd_usecs();
+
+	// A reader upgrading goes first, once the other readers are gone;
+	// until then, nobody else is let in.
+	if ((w = l->upgrader)) {
+		if (l->read_lock_cnt != 1 || l->range_read_cnt != 0
+		    || l->range_write_cnt != 0)
+			return;
+		osprd_stat_hist(l, wait_us, now - w->queued);
+		l->upgrader = NULL;
+		l->read_lock_cnt --;
+		l->write_lock_cnt ++;
+		spin_lock(&osprd_wfg_lock);
+		hlist_del(&w->hash);
+		spin_unlock(&osprd_wfg_lock);
+		w->granted = 1;
+		osprd_lock_wake(l, w);
+	}
+
+	while (!list_empty(&l->waiters)) {
+		w = list_entry(l->waiters.next, struct osprd_waiter, list);
+		if (l->write_lock_cnt != 0 || l->range_write_cnt != 0
+		    || (w->writable && (l->read_lock_cnt != 0
+					|| l->range_read_cnt != 0)))
+			break;
+
+		list_del_init(&w->list);
+		if (w->writable)
+			l->write_lock_cnt ++;
+		else
+			l->read_lock_cnt ++;
+		osprd_stat_inc(l, acquires);
+		osprd_stat_hist(l, wait_us, now - w->queued);
+		w->holder->since = now;
+		spin_lock(&osprd_wfg_lock);
+		hlist_del(&w->hash);
+		link_pid(&l->locking_procs, w->holder);
+		spin_unlock(&osprd_wfg_lock);
+		w->granted = 1;
+		osprd_lock_wake(l, w);
+	}
+
+	l->ticket_tail = list_empty(&l->waiters) ? l->ticket_head
+		: list_entry(l->waiters.next, struct osprd_waiter, list)->ticket;
+}
+
+/*
+ * osprd_wfg_follow(s, pid)
+ *   Note in search 's' that the process it started from (transitively)
+ *   waits for process 'pid', and queue whatever 'pid' itself waits for.
+ */
+static void osprd_wfg_follow(struct osprd_wfg_search *s, pid_t pid)
+{
+	struct osprd_waiter *w;
+	struct hlist_node *n;
+
+	if (pid == s->pid) {
+		s->found = 1;
+		return;
+	}
+	// A process can wait on several devices at once with
+	// OSPRDIOCACQUIREASYNC.
+	hlist_for_each_entry(w, n, osprd_waiting_head(pid), hash) {
+		if (w->pid != pid)
+			continue;
+		if (!w->lock) {
+			if (w->wfg_visit != s->visit) {
+				w->wfg_visit = s->visit;
+				w->wfg_next = s->wwork;
+				s->wwork = w;
+			}
+		} else if (s->upgrading && w->lock == s->start)
+			// It's stuck behind our upgrade
+			s->found = 1;
+		else if (w->lock->wfg_visit != s->visit) {
+			w->lock->wfg_visit = s->visit;
+			w->lock->wfg_next = s->work;
+			s->work = w->lock;
+		}
+	}
+}
+
+/*
+ * osprd_wfg_search(s)
+ *   Run search 's', set up with its starting point queued, and return
+ *   1 if it found a cycle back to 's->pid'.  Each device and includer
+ *   wait is searched at most once, so this costs at most one pass over
+ *   all holders.  A device anybody waits for has been drained of
+ *   fast-path readers.
+ */
+static int osprd_wfg_search(struct osprd_wfg_search *s)
+{
+	struct osprd_lock *e;
+	struct osprd_waiter *w;
+	pid_node_t p;
+
+	while (!s->found && (s->work || s->wwork)) {
+		if ((e = s->work)) {
+			s->work = e->wfg_next;
+			for (p = e->locking_procs.head; p && !s->found;
+			     p = p->next)
+				// An upgrader waits for the other holders only
+				if (!(s->upgrading && e == s->start
+				      && p->pid == s->pid))
+					osprd_wfg_follow(s, p->pid);
+			if (!s->found)
+				osprd_wfg_holders(s, e);
+		} else {
+			w = s->wwork;
+			s->wwork = w->wfg_next;
+			osprd_wfg_blockers(s, w);
+		}
+	}
+	return s->found;
+}
+
+/*
+ * check_deadlock(l, pid, writable, upgrading)
+ *   Return 1 if process 'pid' would deadlock waiting for 'l' ('writable'
+ *   says in which mode): that is, if it holds 'l' or holds a lock that
+ *   some holder of 'l' is (transitively) waiting for.  'l' must be
+ *   drained of fast-path readers.
+ *   If 'upgrading', 'pid' holds a read lock on 'l' and waits for the
+ *   other holders only; then anybody they wait for who waits on 'l' is
+ *   stuck behind us.
+ */
+static int check_deadlock(struct osprd_lock *l, pid_t pid, int writable,
+			  int upgrading)
+{
+	struct osprd_wfg_search s;
+
+	s.pid = pid;
+	s.start = l;
+	s.writable = writable;
+	s.upgrading = upgrading;
+	s.wwork = NULL;
+	s.found = 0;
+	spin_lock(&osprd_wfg_lock);
+	s.visit = ++osprd_wfg_visit;
+	l->wfg_visit = s.visit;
+	l->wfg_next = NULL;
+	s.work = l;
+	osprd_wfg_search(&s);
+	spin_unlock(&osprd_wfg_lock);
+
+	return s.found;
+}
+
+/*
+ * check_deadlock_waiter(w)
+ *   Return 1 if 'w->pid' would deadlock waiting as the includer's waiter
+ *   'w' (one with no 'lock') describes; 'w' need not be in the table
+ *   yet.
+ */
+static inline int check_deadlock_waiter(struct osprd_waiter *w)
+{
+	struct osprd_wfg_search s;
+
+	s.pid = w->pid;
+	s.start = NULL;
+	s.writable = s.upgrading = 0;
+	s.work = NULL;
+	s.found = 0;
+	spin_lock(&osprd_wfg_lock);
+	s.visit = ++osprd_wfg_visit;
+	w->wfg_visit = s.visit;
+	w->wfg_next = NULL;
+	s.wwork = w;
+	osprd_wfg_search(&s);
+	spin_unlock(&osprd_wfg_lock);
+
+	return s.found;
+}
+
+/*
+ * check_deadlock_vector(locks, n, pid)
+ *   Return 1 if process 'pid' would deadlock waiting for all 'n' locks
+ *   at once, in one search from all of them.  Each must be drained of
+ *   fast-path readers, and must stay locked by the caller until 'pid'
+ *   has queued on every one, or another process could start waiting on
+ *   one it is granted before its waits for the rest are in the graph.
+ */
+static inline int check_deadlock_vector(struct osprd_lock **locks,
+					unsigned n, pid_t pid)
+{
+	struct osprd_wfg_search s;
+	unsigned i;
+
+	s.pid = pid;
+	s.start = NULL;
+	s.writable = s.upgrading = 0;
+	s.work = NULL;
+	s.wwork = NULL;
+	s.found = 0;
+	spin_lock(&osprd_wfg_lock);
+	s.visit = ++osprd_wfg_visit;
+	for (i = 0; i < n; i++) {
+		locks[i]->wfg_visit = s.visit;
+		locks[i]->wfg_next = s.work;
+		s.work = locks[i];
+	}
+	osprd_wfg_search(&s);
+	spin_unlock(&osprd_wfg_lock);
+
+	return s.found;
+}
+
+/*
+ * osprd_lock_queue(l, w, holder, pid, writable)
+ *   Queue 'w' for the lock on behalf of process 'pid', and grant it at
+ *   once if it's next and the lock is free; 'holder' joins
+ *   'locking_procs' on grant.  The caller has checked for a deadlock,
+ *   sets 'w's environment fields, and waits for 'w->granted'.
+ */
+static void osprd_lock_queue(struct osprd_lock *l, struct osprd_waiter *w,
+			     pid_node_t holder, pid_t pid, int writable)
+{
+	w->lock = l;
+	w->pid = holder->pid = pid;
+	w->holder = holder;
+	w->ticket = holder->ticket = l->ticket_head;
+	w->writable = writable;
+	w->granted = 0;
+	w->queued = osprd_usecs();
+	osprd_stat_hist(l, depth, l->ticket_head - l->ticket_tail);
+	l->ticket_head ++;
+	l->nwaiters ++;
+	list_add_tail(&w->list, &l->waiters);
+	spin_lock(&osprd_wfg_lock);
+	hlist_add_head(&w->hash, osprd_waiting_head(pid));
+	spin_unlock(&osprd_wfg_lock);
+	// We may be next and the lock free
+	osprd_grant_waiters(l);
+}
+
+/*
+ * osprd_lock_acquire(l, w, holder, pid, writable)
+ *   Queue 'w' as osprd_lock_queue() does, but return -EDEADLK instead
+ *   if waiting would deadlock.  Waits for 'w->granted' if this returns
+ *   0.
+ */
+static int osprd_lock_acquire(struct osprd_lock *l, struct osprd_waiter *w,
+			      pid_node_t holder, pid_t pid, int writable)
+{
+	if (check_deadlock(l, pid, writable, 0)) {
+		osprd_stat_inc(l, deadlocks);
+		return -EDEADLK;
+	}
+	osprd_lock_queue(l, w, holder, pid, writable);
+	return 0;
+}
+
+/* Take the lock for 'pid' if nobody holds it in a conflicting mode and
+ * nobody waits, or return -EBUSY.  It's busy for a process that holds it
+ * already, where osprd_lock_acquire() would find a deadlock. */
+static int osprd_lock_try(struct osprd_lock *l, pid_t pid, int writable)
+{
+	// Anyone already waiting is ahead of us; a lock taken without
+	// waiting needs no ticket.
+	if (!list_empty(&l->waiters) || l->upgrader
+	    || has_pid(&l->locking_procs, pid)
+	    || l->write_lock_cnt != 0 || l->range_write_cnt != 0
+	    || (writable && (l->read_lock_cnt != 0
+			     || l->range_read_cnt != 0))) {
+		osprd_stat_inc(l, try_failures);
+		return -EBUSY;
+	}
+
+	if (writable)
+		l->write_lock_cnt ++;
+	else
+		l->read_lock_cnt ++;
+	spin_lock(&osprd_wfg_lock);
+	add_pid(&l->locking_procs, pid, l->ticket_head);
+	spin_unlock(&osprd_wfg_lock);
+	osprd_stat_inc(l, acquires);
+	osprd_stat_hist(l, wait_us, 0);
+	return 0;
+}
+
+/*
+ * osprd_lock_upgrade(l, w, pid)
+ *   Queue 'w' to trade 'pid's read lock for the write lock.  It goes
+ *   ahead of the queue and waits only for the other readers to leave;
+ *   nobody else gets the lock meanwhile.  Two readers upgrading at once
+ *   would wait for each other, so the second gets -EDEADLK.
+ */
+static int osprd_lock_upgrade(struct osprd_lock *l, struct osprd_waiter *w,
+			      pid_t pid)
+{
+	if (l->upgrader || check_deadlock(l, pid, 1, 1)) {
+		osprd_stat_inc(l, deadlocks);
+		return -EDEADLK;
+	}
+
+	INIT_LIST_HEAD(&w->list);
+	w->lock = l;
+	w->pid = pid;
+	w->holder = NULL;
+	w->writable = 1;
+	w->granted = 0;
+	w->queued = osprd_usecs();
+	l->upgrader = w;
+	l->nwaiters ++;
+	spin_lock(&osprd_wfg_lock);
+	hlist_add_head(&w->hash, osprd_waiting_head(pid));
+	spin_unlock(&osprd_wfg_lock);
+	// We may be the only reader
+	osprd_grant_waiters(l);
+	return 0;
+}
+
+/* Take back 'w', which gave up waiting before it was granted; an
+ * upgrader keeps its read lock.  The caller frees 'w->holder'. */
+static void osprd_lock_abandon(struct osprd_lock *l, struct osprd_waiter *w)
+{
+	if (l->upgrader == w)
+		l->upgrader = NULL;
+	else
+		list_del(&w->list);
+	spin_lock(&osprd_wfg_lock);
+	hlist_del(&w->hash);
+	spin_unlock(&osprd_wfg_lock);
+	// If it was next, the waiter behind it may be able to go
+	osprd_grant_waiters(l);
+}
+
+/* Release 'pid's lock, a write lock if 'writable', and let in whoever
+ * can go next. */
+static void osprd_lock_release(struct osprd_lock *l, pid_t pid, int writable)
+{
+	pid_node_t holder;
+
+	if (writable)
+		l->write_lock_cnt --;
+	else
+		l->read_lock_cnt --;
+	spin_lock(&osprd_wfg_lock);
+	if ((holder = has_pid(&l->locking_procs, pid)))
+		osprd_stat_hist(l, hold_us, osprd_usecs() - holder->since);
+	remove_pid(&l->locking_procs, pid);
+	spin_unlock(&osprd_wfg_lock);
+	osprd_grant_waiters(l);
+}
+
+/* Trade a write lock for a read lock, and let in the readers at the
+ * head of the queue with us. */
+static void osprd_lock_downgrade(struct osprd_lock *l)
+{
+	l->write_lock_cnt --;
+	l->read_lock_cnt ++;
+	osprd_grant_waiters(l);
+}
+
+#endif /* OSPRDLOCK_H */
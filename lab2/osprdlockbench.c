@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "osprd.h"
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Measures OSP ramdisk lock throughput.\n\
+Usage: ./osprdlockbench [-r READERS] [-w WRITERS] [-t SECONDS] [-d NDEV]\n\
+                        [DEVICE]\n\
+   Starts READERS processes (default 8) that open DEVICE read-only and\n\
+   WRITERS processes (default 0) that open it for writing.  Each one\n\
+   acquires and releases the device lock in a loop for SECONDS seconds\n\
+   (default 5); then the total number of lock/unlock pairs is printed,\n\
+   with the number of context switches the processes made per pair.\n\
+   Many writers (say -r 0 -w 100) keep a long queue behind each\n\
+   release; compare context switches per pair across module builds.\n\
+   The mean time an acquire takes is printed too.\n\
+   DEVICE defaults to /dev/osprda.  With -d, the processes are spread\n\
+   round-robin over NDEV devices: DEVICE and the NDEV - 1 devices named\n\
+   after it (/dev/osprdb, /dev/osprdc, ...).\n");
+	exit(status);
+}
+
+int parse_int(const char *arg, int *result)
+{
+	char *end_arg;
+	long val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg && val >= 0) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+struct result {
+	unsigned long count;		// lock/unlock pairs
+	double acquire_time;		// seconds spent acquiring
+};
+
+// Lock and unlock 'devname' until 'deadline', then write a struct result
+// to 'outfd'.
+void hammer(const char *devname, int mode, double deadline, int outfd)
+{
+	struct result res = { 0, 0 };
+	double t;
+	int devfd = open(devname, mode);
+	if (devfd == -1) {
+		perror("open");
+		exit(1);
+	}
+
+	while ((t = now()) < deadline) {
+		if (ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
+			perror("ioctl OSPRDIOCACQUIRE");
+			exit(1);
+		}
+		res.acquire_time += now() - t;
+		if (ioctl(devfd, OSPRDIOCRELEASE, NULL) == -1) {
+			perror("ioctl OSPRDIOCRELEASE");
+			exit(1);
+		}
+		res.count++;
+	}
+
+	if (write(outfd, &res, sizeof(res)) != sizeof(res)) {
+		perror("write");
+		exit(1);
+	}
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	int nreaders = 8, nwriters = 0, seconds = 5, ndev = 1;
+	const char *devname = "/dev/osprda";
+	char *name;
+	int i, pfd[2];
+	struct result res;
+	unsigned long total = 0;
+	double acquire_time = 0;
+	double start, deadline, elapsed;
+	struct rusage ru;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+		if (!parse_int(argv[2], &nreaders))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-w") == 0) {
+		if (!parse_int(argv[2], &nwriters))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		if (!parse_int(argv[2], &seconds))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-d") == 0) {
+		if (!parse_int(argv[2], &ndev) || ndev < 1)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0
+				 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+
+	if (argc == 2 && argv[1][0] != '-')
+		devname = argv[1];
+	else if (argc != 1)
+		usage(1);
+
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+
+	start = now();
+	deadline = start + seconds;
+	for (i = 0; i < nreaders + nwriters; i++) {
+		pid_t p = fork();
+		if (p == -1) {
+			perror("fork");
+			exit(1);
+		} else if (p == 0) {
+			close(pfd[0]);
+			name = strdup(devname);
+			name[strlen(name) - 1] += i % ndev;
+			hammer(name, i < nreaders ? O_RDONLY : O_WRONLY,
+			       deadline, pfd[1]);
+		}
+	}
+	close(pfd[1]);
+
+	while (read(pfd[0], &res, sizeof(res)) == sizeof(res)) {
+		total += res.count;
+		acquire_time += res.acquire_time;
+	}
+	while (wait(NULL) != -1)
+		/* reap */;
+	elapsed = now() - start;
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	printf("%d readers, %d writers, %d devices: %lu lock/unlock pairs in %.2f s (%.0f/s)\n",
+	       nreaders, nwriters, ndev, total, elapsed, total / elapsed);
+	printf("%.2f us per acquire\n",
+	       total ? acquire_time * 1000000 / total : 0.0);
+	printf("%.2f context switches per pair (%ld voluntary, %ld involuntary)\n",
+	       total ? (double) (ru.ru_nvcsw + ru.ru_nivcsw) / total : 0.0,
+	       ru.ru_nvcsw, ru.ru_nivcsw);
+	exit(0);
+}
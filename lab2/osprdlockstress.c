@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osprdlock.h"
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Stress-tests the OSP ramdisk lock in user space.\n\
+Usage: ./osprdlockstress [-t THREADS] [-d NDEV] [-s SECONDS] [-w PERCENT]\n\
+                         [-r SEED]\n\
+   Runs the driver's lock code (osprdlock.h) against NDEV pretend\n\
+   devices (default 4), with THREADS threads (default 8) standing in\n\
+   for processes.  For SECONDS seconds (default 2) each thread picks\n\
+   devices and operations at random: blocking and non-blocking\n\
+   acquires, some given up after a timeout as a signal would, upgrades,\n\
+   downgrades and releases.  PERCENT of acquires (default 20) are for\n\
+   write locks.  A thread may hold several devices at once, so some\n\
+   acquires must fail with EDEADLK.\n\
+   Every grant is checked against what the other threads hold, and\n\
+   waiters must be granted in ticket order.  At the end all threads\n\
+   must finish; one that doesn't means a deadlock went undetected.\n\
+   Prints the lock operations per second and the lock statistics, as\n\
+   in /proc/driver/osprd_locks.  Exits 1 if a check failed.\n");
+	exit(status);
+}
+
+int parse_int(const char *arg, int *result)
+{
+	char *end_arg;
+	long val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg && val >= 0) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// A pretend device: the lock, the mutex standing in for 'd->mutex', and
+// what the threads think they hold, to check the lock against.
+struct device {
+	pthread_mutex_t mutex;
+	struct osprd_lock lock;
+	struct osprd_lockstats stats;
+	int readers;			// Threads holding a read lock
+	int writers;			// Threads holding the write lock
+	unsigned last_ticket;		// Last ticket granted after waiting
+	int granted_any;
+};
+
+// A waiter sleeps on its own condition variable, so a grant wakes just
+// the threads it granted, as wake_up_process() does in the kernel.
+struct stress_waiter {
+	struct osprd_waiter w;
+	pthread_cond_t cond;
+};
+
+struct thread {
+	pthread_t thread;
+	pid_t pid;
+	unsigned seed;
+	int *held;			// Per device: 0, 'r' or 'w'
+	int nheld;			// Devices held
+	unsigned long ops;		// Lock operations that succeeded
+};
+
+static struct device *devices;
+static int ndev = 4, write_percent = 20;
+static volatile int stop;
+static int failed;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int ndone;
+
+#define check(d, cond) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "device %d: check failed: %s\n", \
+				(int) ((d) - devices), #cond);		\
+			failed = 1;					\
+		}							\
+	} while (0)
+
+static void osprd_lock_wake(struct osprd_lock *l, struct osprd_waiter *w)
+{
+	struct device *d = container_of(l, struct device, lock);
+
+	// Readers granted as a batch share a ticket order with writers, so
+	// grants after waiting must go strictly by ticket.  An upgrader
+	// has no ticket.
+	if (w->holder) {
+		check(d, !d->granted_any || (int) (w->ticket - d->last_ticket) > 0);
+		d->last_ticket = w->ticket;
+		d->granted_any = 1;
+	}
+	pthread_cond_signal(&container_of(w, struct stress_waiter, w)->cond);
+}
+
+// There are no range locks here, so no waits besides the devices'.
+static void osprd_wfg_holders(struct osprd_wfg_search *s,
+			      struct osprd_lock *l)
+{
+	(void) s, (void) l;
+}
+
+static void osprd_wfg_blockers(struct osprd_wfg_search *s,
+			       struct osprd_waiter *w)
+{
+	(void) s, (void) w;
+}
+
+// Record that 't' now holds 'd' in mode 'mode', checking nobody else
+// holds it in a conflicting mode.  Called with 'd->mutex' held.
+static void now_holds(struct thread *t, struct device *d, int mode)
+{
+	if (mode == 'w') {
+		check(d, d->readers == 0 && d->writers == 0);
+		d->writers++;
+	} else {
+		check(d, d->writers == 0);
+		d->readers++;
+	}
+	check(d, d->lock.write_lock_cnt == (unsigned) d->writers);
+	t->held[d - devices] = mode;
+	t->nheld++;
+	t->ops++;
+}
+
+// Wait for 'sw' to be granted, giving up after 'timeout_us' if it isn't
+// 0.  Returns 1 if it was granted.  Called with 'd->mutex' held.
+static int wait_grant(struct device *d, struct stress_waiter *sw,
+		      long timeout_us)
+{
+	struct timespec ts;
+	int r = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += timeout_us * 1000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+	while (!sw->w.granted && r != ETIMEDOUT)
+		if (timeout_us)
+			r = pthread_cond_timedwait(&sw->cond, &d->mutex, &ts);
+		else
+			pthread_cond_wait(&sw->cond, &d->mutex);
+	d->lock.nwaiters--;
+	if (!sw->w.granted) {
+		osprd_lock_abandon(&d->lock, &sw->w);
+		osprd_stat_inc(&d->lock, interrupted);
+	}
+	return sw->w.granted;
+}
+
+static void acquire(struct thread *t, struct device *d, int writable)
+{
+	struct stress_waiter sw;
+	pid_node_t holder = malloc(sizeof(*holder));
+	long timeout_us = rand_r(&t->seed) % 4 ? 0 : rand_r(&t->seed) % 2000;
+
+	pthread_cond_init(&sw.cond, NULL);
+	pthread_mutex_lock(&d->mutex);
+	if (osprd_lock_acquire(&d->lock, &sw.w, holder, t->pid, writable) < 0)
+		free(holder);
+	else if (wait_grant(d, &sw, timeout_us))
+		now_holds(t, d, writable ? 'w' : 'r');
+	else
+		free(holder);
+	pthread_mutex_unlock(&d->mutex);
+	pthread_cond_destroy(&sw.cond);
+}
+
+static void try_acquire(struct thread *t, struct device *d, int writable)
+{
+	pthread_mutex_lock(&d->mutex);
+	if (osprd_lock_try(&d->lock, t->pid, writable) == 0)
+		now_holds(t, d, writable ? 'w' : 'r');
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static void upgrade(struct thread *t, struct device *d)
+{
+	struct stress_waiter sw;
+	long timeout_us = rand_r(&t->seed) % 2 ? 0 : rand_r(&t->seed) % 2000;
+
+	pthread_cond_init(&sw.cond, NULL);
+	pthread_mutex_lock(&d->mutex);
+	if (osprd_lock_upgrade(&d->lock, &sw.w, t->pid) == 0
+	    && wait_grant(d, &sw, timeout_us)) {
+		check(d, d->readers == 1 && d->writers == 0);
+		d->readers--;
+		d->writers++;
+		t->held[d - devices] = 'w';
+		t->ops++;
+	}
+	pthread_mutex_unlock(&d->mutex);
+	pthread_cond_destroy(&sw.cond);
+}
+
+static void downgrade(struct thread *t, struct device *d)
+{
+	pthread_mutex_lock(&d->mutex);
+	d->writers--;
+	d->readers++;
+	t->held[d - devices] = 'r';
+	osprd_lock_downgrade(&d->lock);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static void release(struct thread *t, struct device *d)
+{
+	int writable = t->held[d - devices] == 'w';
+
+	pthread_mutex_lock(&d->mutex);
+	if (writable)
+		d->writers--;
+	else
+		d->readers--;
+	t->held[d - devices] = 0;
+	t->nheld--;
+	osprd_lock_release(&d->lock, t->pid, writable);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static void *stress(void *arg)
+{
+	struct thread *t = arg;
+	struct device *d;
+	int i, op;
+
+	while (!stop) {
+		d = &devices[rand_r(&t->seed) % ndev];
+		op = rand_r(&t->seed) % 100;
+		// Hold at most two devices, so that a fair share of acquires
+		// can succeed.
+		if (!t->held[d - devices] && t->nheld == 2) {
+			for (i = 0; !t->held[i]; i++)
+				/* find one */;
+			release(t, &devices[i]);
+		} else if (!t->held[d - devices]) {
+			int writable = rand_r(&t->seed) % 100 < write_percent;
+			if (op < 25)
+				try_acquire(t, d, writable);
+			else
+				acquire(t, d, writable);
+		} else if (op < 10 && t->held[d - devices] == 'r')
+			upgrade(t, d);
+		else if (op < 20 && t->held[d - devices] == 'w')
+			downgrade(t, d);
+		else
+			release(t, d);
+	}
+
+	for (i = 0; i < ndev; i++)
+		if (t->held[i])
+			release(t, &devices[i]);
+	pthread_mutex_lock(&done_lock);
+	ndone++;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_lock);
+	return NULL;
+}
+
+// Print the nonzero buckets of a log2 histogram as "RANGE:COUNT".
+void print_hist(const char *name, const unsigned long *hist)
+{
+	int b;
+
+	printf("  %s", name);
+	for (b = 0; b < OSPRD_HIST_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		if (b <= 1)
+			printf(" %d:%lu", b, hist[b]);
+		else
+			printf(" %lu-%lu:%lu", 1UL << (b - 1),
+			       (1UL << b) - 1, hist[b]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int nthreads = 8, seconds = 2, seed = 0;
+	int i, b;
+	struct thread *threads;
+	struct osprd_lockstats sum;
+	struct timespec ts;
+	unsigned long total = 0;
+	double start, elapsed;
+
+ flag:
+	if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+		if (!parse_int(argv[2], &nthreads) || nthreads < 1)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-d") == 0) {
+		if (!parse_int(argv[2], &ndev) || ndev < 1)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+		if (!parse_int(argv[2], &seconds))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-w") == 0) {
+		if (!parse_int(argv[2], &write_percent) || write_percent > 100)
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+		if (!parse_int(argv[2], &seed))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	} else if (argc >= 2 && (strcmp(argv[1], "-h") == 0
+				 || strcmp(argv[1], "--help") == 0))
+		usage(0);
+	if (argc != 1)
+		usage(1);
+
+	devices = calloc(ndev, sizeof(*devices));
+	for (i = 0; i < ndev; i++) {
+		pthread_mutex_init(&devices[i].mutex, NULL);
+		osprd_lock_init(&devices[i].lock);
+		devices[i].lock.stats = &devices[i].stats;
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	start = now();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].pid = i + 1;
+		threads[i].seed = seed * nthreads + i;
+		threads[i].held = calloc(ndev, sizeof(int));
+		if (pthread_create(&threads[i].thread, NULL, stress,
+				   &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+
+	// Everybody lets go once told to stop, so every waiter gets its
+	// lock soon after; give them a few seconds.
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 5;
+	pthread_mutex_lock(&done_lock);
+	while (ndone < nthreads
+	       && pthread_cond_timedwait(&done_cond, &done_lock, &ts) == 0)
+		/* wait */;
+	if (ndone < nthreads) {
+		fprintf(stderr, "%d threads stuck: undetected deadlock\n",
+			nthreads - ndone);
+		exit(1);
+	}
+	pthread_mutex_unlock(&done_lock);
+	elapsed = now() - start;
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		total += threads[i].ops;
+	}
+	for (i = 0; i < ndev; i++) {
+		struct device *d = &devices[i];
+		check(d, d->lock.read_lock_cnt == 0
+		      && d->lock.write_lock_cnt == 0
+		      && d->lock.nwaiters == 0
+		      && d->lock.locking_procs.head == NULL);
+		sum.acquires += d->stats.acquires;
+		sum.try_failures += d->stats.try_failures;
+		sum.deadlocks += d->stats.deadlocks;
+		sum.interrupted += d->stats.interrupted;
+		for (b = 0; b < OSPRD_HIST_BUCKETS; b++) {
+			sum.wait_us[b] += d->stats.wait_us[b];
+			sum.hold_us[b] += d->stats.hold_us[b];
+			sum.depth[b] += d->stats.depth[b];
+		}
+	}
+
+	printf("%d threads, %d devices: %lu lock operations in %.2f s (%.0f/s)\n",
+	       nthreads, ndev, total, elapsed, total / elapsed);
+	printf("%lu acquires, %lu try failures, %lu deadlocks, %lu interrupted\n",
+	       sum.acquires, sum.try_failures, sum.deadlocks, sum.interrupted);
+	print_hist("wait_us", sum.wait_us);
+	print_hist("hold_us", sum.hold_us);
+	print_hist("depth", sum.depth);
+	if (failed)
+		printf("FAILED\n");
+	exit(failed);
+}